@@ -4,14 +4,39 @@
 #include <set>
 #include <numeric>
 #include <vector>
+#include <deque>
+#include <string_view>
+#include <charconv>
 #include <tuple>
+#include <array>
+#include <initializer_list>
 #include <functional>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <exception>
+#include <stdexcept>
 
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <cstring>
+#include <type_traits>
+#include <limits>
+
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <unistd.h>
 
 #include <cxxopts.hpp>
 #include <IITree.h>
@@ -26,18 +51,24 @@
 #include <iostream>
 
 #include <cassert>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
 
 using std::string;
 using std::ostream;
 using std::vector;
 
-template< class B>
-inline void print_tsv(ostream &ost, B b){
+template< class O, class B>
+inline void print_tsv(O &ost, B b){
     ost << b << "\n";
 }
 
-template <class B, class... A>
-inline void print_tsv(ostream &ost, B b, A... a){
+template <class O, class B, class... A>
+inline void print_tsv(O &ost, B b, A... a){
     ost << b << "\t";
     print_tsv(ost, a...);
 }
@@ -46,11 +77,588 @@ inline void print_tsv(ostream &ost, B b, A... a){
 namespace annotate{
 
 
+    // Splits line on delimiter into views of line, reusing the storage of fields.
+    // Like rsplit, n delimiters give n+1 fields.
+    inline void split_fields(std::string_view line, char delimiter, vector<std::string_view> &fields){
+        fields.clear();
+        size_t begin = 0;
+        for(size_t pos = line.find(delimiter); pos != std::string_view::npos; pos = line.find(delimiter, begin)){
+            fields.push_back(line.substr(begin, pos - begin));
+            begin = pos + 1;
+        }
+        fields.push_back(line.substr(begin));
+    }
+
+    inline std::string_view trim(std::string_view field){
+        size_t begin = field.find_first_not_of(" \t\r");
+        if(begin == std::string_view::npos){
+            return std::string_view();
+        }
+        size_t end = field.find_last_not_of(" \t\r");
+        return field.substr(begin, end - begin + 1);
+    }
+
+    // Leading number of field, throws std::invalid_argument if there is none (as stoi and stof do)
+    template<class T>
+    T parse_number(std::string_view field){
+        field = trim(field);
+        if(!field.empty() && field[0] == '+'){
+            field.remove_prefix(1);
+        }
+        T value{};
+#if defined(__cpp_lib_to_chars)
+        auto result = std::from_chars(field.data(), field.data() + field.size(), value);
+        if(result.ec != std::errc()){
+            throw std::invalid_argument("parse_number: " + string(field));
+        }
+#else
+        if constexpr (std::is_integral_v<T>){
+            auto result = std::from_chars(field.data(), field.data() + field.size(), value);
+            if(result.ec != std::errc()){
+                throw std::invalid_argument("parse_number: " + string(field));
+            }
+        }
+        else{
+            value = static_cast<T>(std::stod(string(field)));
+        }
+#endif
+        return value;
+    }
+
+    // Value of the attribute key in a GTF attribute column (key "value"; key "value"; ...), quotes removed.
+    // Returns false if the attribute is missing.
+    inline bool gtf_attribute(std::string_view attributes, std::string_view key, std::string_view &value){
+        while(!attributes.empty()){
+            size_t end = attributes.find(';');
+            std::string_view field = trim(attributes.substr(0, end));
+            attributes = end == std::string_view::npos ? std::string_view() : attributes.substr(end + 1);
+
+            if(field.size() <= key.size() || field.compare(0, key.size(), key) != 0 ||
+                    (field[key.size()] != ' ' && field[key.size()] != '\t')){
+                continue;
+            }
+            value = trim(field.substr(key.size()));
+            if(value.size() >= 2 && value.front() == '"' && value.back() == '"'){
+                value = value.substr(1, value.size() - 2);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Part of id before the first '.', which drops Ensembl version suffixes
+    inline std::string_view strip_version(std::string_view id){
+        return id.substr(0, id.find('.'));
+    }
+
+    // Number of workers parallel_for_workers starts for n items
+    inline size_t worker_count(size_t n, size_t thread_count){
+        return std::max<size_t>(1, std::min(thread_count, n));
+    }
+
+    // Runs f(worker, i) for every i in [0, n) on worker_count(n, thread_count) threads, in no particular order.
+    // worker is in [0, worker_count) and lets f keep per thread scratch space. The first exception f throws
+    // stops the items not yet started and is rethrown here once every worker has finished.
+    template<class F>
+    void parallel_for_workers(size_t n, size_t thread_count, F f){
+        size_t workers_needed = worker_count(n, thread_count);
+        if(workers_needed == 1){
+            for(size_t i = 0; i < n; ++i){
+                f(0, i);
+            }
+            return;
+        }
+        std::atomic<size_t> next{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        auto worker = [&] (size_t w) {
+            try{
+                for(size_t i = next++; i < n; i = next++){
+                    f(w, i);
+                }
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if(error == NULL){
+                    error = std::current_exception();
+                }
+                next = n;
+            }
+        };
+        vector<std::thread> workers;
+        for(size_t w = 1; w < workers_needed; ++w){
+            workers.emplace_back(worker, w);
+        }
+        worker(0);
+        for(auto &w : workers){
+            w.join();
+        }
+        if(error != NULL){
+            std::rethrow_exception(error);
+        }
+    }
 
-    ostream& operator<<(ostream& os, const locus &lc){
-        os << lc.chr << "\t" << lc.position;
-        return os;
+    // Runs f(i) for every i in [0, n) on up to thread_count threads, in no particular order
+    template<class F>
+    void parallel_for(size_t n, size_t thread_count, F f){
+        parallel_for_workers(n, thread_count, [&f] (size_t, size_t i) { f(i); });
     }
+
+    // Input or output error while annotating one sample. The helpers annotate_sample reaches throw it
+    // rather than exit, so a batch or served job fails only that sample; the entry points exit on it.
+    class annotate_error : public std::runtime_error{
+        public:
+        using std::runtime_error::runtime_error;
+    };
+
+    // Wall and CPU time and item counts of the annotate stages, written as JSON. Stages run one after another;
+    // a disabled profiler records nothing. CPU time is the whole process', so it includes every worker thread.
+    class stage_profiler{
+        using clock = std::chrono::steady_clock;
+        struct stage{
+            string name;
+            double wall_seconds;
+            double cpu_seconds;
+            vector<std::pair<string, uint64_t>> counts;
+        };
+
+        bool enabled;
+        vector<stage> stages;
+        bool in_stage {false};
+        clock::time_point start_wall;
+        std::clock_t start_cpu;
+        clock::time_point stage_wall;
+        std::clock_t stage_cpu;
+
+        static double seconds_since(clock::time_point start){
+            return std::chrono::duration<double>(clock::now() - start).count();
+        }
+        static double cpu_seconds_since(std::clock_t start){
+            return static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+        }
+
+        public:
+        explicit stage_profiler(bool enabled = false) : enabled(enabled), start_wall(clock::now()), start_cpu(std::clock()) {}
+
+        bool is_enabled() const{
+            return enabled;
+        }
+        // Ends the open stage, if any, and starts timing name
+        void begin(const string &name){
+            if(!enabled){
+                return;
+            }
+            end();
+            stages.push_back({name, 0, 0, {}});
+            in_stage = true;
+            stage_wall = clock::now();
+            stage_cpu = std::clock();
+        }
+        void end(){
+            if(!enabled || !in_stage){
+                return;
+            }
+            stages.back().wall_seconds = seconds_since(stage_wall);
+            stages.back().cpu_seconds = cpu_seconds_since(stage_cpu);
+            in_stage = false;
+        }
+        // Adds value to a count of the latest stage
+        void count(const string &key, uint64_t value){
+            if(!enabled || stages.empty()){
+                return;
+            }
+            auto &counts = stages.back().counts;
+            auto it = std::find_if(counts.begin(), counts.end(), [&key] (const std::pair<string, uint64_t> &c) { return c.first == key; });
+            if(it == counts.end()){
+                counts.emplace_back(key, value);
+            }
+            else{
+                it->second += value;
+            }
+        }
+        bool write_json(const string &path, size_t thread_count){
+            if(!enabled){
+                return true;
+            }
+            end();
+            std::ofstream out(path);
+            if(!out.is_open()){
+                std::cerr << "[WARNING] Cannot write profile: " << path << std::endl;
+                return false;
+            }
+            rusage usage;
+            long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+            out << std::fixed << std::setprecision(6);
+            out << "{\n";
+            out << "  \"threads\": " << thread_count << ",\n";
+            out << "  \"wall_seconds\": " << seconds_since(start_wall) << ",\n";
+            out << "  \"cpu_seconds\": " << cpu_seconds_since(start_cpu) << ",\n";
+            out << "  \"peak_rss_kb\": " << peak_rss_kb << ",\n";
+            out << "  \"stages\": [";
+            for(size_t i = 0; i < stages.size(); ++i){
+                const stage &st = stages[i];
+                out << (i == 0 ? "\n" : ",\n");
+                out << "    {\"name\": \"" << st.name << "\", \"wall_seconds\": " << st.wall_seconds
+                    << ", \"cpu_seconds\": " << st.cpu_seconds << ", \"counts\": {";
+                for(size_t k = 0; k < st.counts.size(); ++k){
+                    out << (k == 0 ? "" : ", ") << "\"" << st.counts[k].first << "\": " << st.counts[k].second;
+                }
+                out << "}}";
+            }
+            out << "\n  ]\n}\n";
+            return true;
+        }
+    };
+
+    // Reads plain, gzip or bgzip (BGZF) text line by line. bgzip blocks are inflated in batches
+    // on thread_count threads, other input is read or inflated as one stream.
+    class text_reader{
+        enum class input_format{plain, gzip, bgzip};
+
+        string path;
+        int fd {-1};
+        input_format format {input_format::plain};
+        size_t thread_count;
+        vector<unsigned char> input; // bytes read from fd and not consumed, from input_pos
+        size_t input_pos {0};
+        bool input_end {false};
+        z_stream stream; // gzip input only
+        bool stream_open {false};
+        bool stream_end {false};
+        string text; // decompressed text, consumed up to text_pos
+        size_t text_pos {0};
+
+        static constexpr size_t read_size = size_t(1) << 20;
+        static constexpr size_t text_size = size_t(4) << 20;
+
+        [[noreturn]] void fail(){
+            throw annotate_error("Cannot decompress file:" + path);
+        }
+        // Makes at least wanted unconsumed bytes available unless the file ends first
+        size_t fill_input(size_t wanted){
+            while(input.size() - input_pos < wanted && !input_end){
+                size_t old_size = input.size();
+                input.resize(old_size + std::max(wanted, read_size));
+                ssize_t got = ::read(fd, input.data() + old_size, input.size() - old_size);
+                if(got < 0){
+                    fail();
+                }
+                input.resize(old_size + got);
+                input_end = got == 0;
+            }
+            return input.size() - input_pos;
+        }
+        void drop_consumed_input(){
+            input.erase(input.begin(), input.begin() + input_pos);
+            input_pos = 0;
+        }
+        // Size of the bgzip block at the start of the unconsumed input, 0 if it is not one
+        size_t bgzip_block_size(){
+            if(fill_input(18) < 18){
+                return 0;
+            }
+            const unsigned char *h = input.data() + input_pos;
+            if(h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)){
+                return 0;
+            }
+            size_t extra_length = h[10] | (h[11] << 8);
+            if(extra_length < 6 || h[12] != 'B' || h[13] != 'C' || (h[14] | (h[15] << 8)) != 2){
+                return 0;
+            }
+            return (h[16] | (h[17] << 8)) + 1;
+        }
+        bool refill_plain(){
+            text.resize(text_size);
+            ssize_t got = ::read(fd, &text[0], text.size());
+            if(got < 0){
+                fail();
+            }
+            text.resize(got);
+            return got > 0;
+        }
+        bool refill_gzip(){
+            text.resize(text_size);
+            stream.next_out = reinterpret_cast<Bytef *>(&text[0]);
+            stream.avail_out = text.size();
+            while(stream.avail_out > 0 && !stream_end){
+                if(stream.avail_in == 0){
+                    input.clear();
+                    input_pos = 0;
+                    if(fill_input(read_size) == 0){
+                        fail(); // truncated
+                    }
+                    stream.next_in = input.data();
+                    stream.avail_in = input.size();
+                }
+                int status = inflate(&stream, Z_NO_FLUSH);
+                if(status == Z_STREAM_END){
+                    // Concatenated members continue the text, anything else after a member ends it
+                    input_pos = input.size() - stream.avail_in;
+                    if(fill_input(2) < 2 || input[input_pos] != 0x1f || input[input_pos + 1] != 0x8b){
+                        stream_end = true;
+                    }
+                    else{
+                        drop_consumed_input();
+                        stream.next_in = input.data();
+                        stream.avail_in = input.size();
+                        inflateReset(&stream);
+                    }
+                }
+                else if(status != Z_OK){
+                    fail();
+                }
+            }
+            text.resize(text.size() - stream.avail_out);
+            return !text.empty();
+        }
+        bool refill_bgzip(){
+            drop_consumed_input();
+            vector<std::pair<size_t, size_t>> blocks; // offset and size in input
+            const size_t batch_size = std::max<size_t>(1, thread_count) * 16;
+            size_t offset = 0;
+            while(blocks.size() < batch_size && fill_input(1) > 0){
+                size_t size = bgzip_block_size();
+                if(size < 26 || fill_input(size) < size){
+                    fail();
+                }
+                blocks.emplace_back(offset, size);
+                offset += size;
+                input_pos += size;
+            }
+            if(blocks.empty()){
+                return false;
+            }
+            vector<string> inflated(blocks.size());
+            std::atomic<bool> broken{false};
+            parallel_for(blocks.size(), thread_count, [&] (size_t i) {
+                const unsigned char *block = input.data() + blocks[i].first;
+                size_t size = blocks[i].second;
+                size_t header_size = 12 + (block[10] | (block[11] << 8));
+                const unsigned char *trailer = block + size - 8;
+                uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+                uint32_t length = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | (uint32_t(trailer[7]) << 24);
+                inflated[i].resize(length);
+
+                z_stream block_stream;
+                std::memset(&block_stream, 0, sizeof(block_stream));
+                bool ok = header_size + 8 <= size && inflateInit2(&block_stream, -15) == Z_OK;
+                if(ok){
+                    block_stream.next_in = const_cast<Bytef *>(block + header_size);
+                    block_stream.avail_in = size - header_size - 8;
+                    block_stream.next_out = reinterpret_cast<Bytef *>(&inflated[i][0]);
+                    block_stream.avail_out = length;
+                    ok = inflate(&block_stream, Z_FINISH) == Z_STREAM_END && block_stream.avail_out == 0;
+                    inflateEnd(&block_stream);
+                }
+                if(!ok || crc32(0, reinterpret_cast<const Bytef *>(inflated[i].data()), length) != crc){
+                    broken = true;
+                }
+            });
+            if(broken){
+                fail();
+            }
+            text.clear();
+            for(const string &block_text : inflated){
+                text += block_text;
+            }
+            return true;
+        }
+        bool refill(){
+            text.clear();
+            text_pos = 0;
+            bool more = false;
+            // empty blocks (such as the bgzip end of file marker) give no text, keep reading
+            do{
+                switch(format){
+                    case input_format::plain:
+                        more = refill_plain();
+                        break;
+                    case input_format::gzip:
+                        more = refill_gzip();
+                        break;
+                    case input_format::bgzip:
+                        more = refill_bgzip();
+                        break;
+                }
+            } while(more && text.empty());
+            return more;
+        }
+
+        public:
+        text_reader(const string &path, size_t thread_count = 1) : path(path), thread_count(thread_count){
+            std::memset(&stream, 0, sizeof(stream));
+            fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0){
+                return;
+            }
+            if(fill_input(2) >= 2 && input[0] == 0x1f && input[1] == 0x8b){
+                if(bgzip_block_size() != 0){
+                    format = input_format::bgzip;
+                }
+                else{
+                    format = input_format::gzip;
+                    if(inflateInit2(&stream, 15 + 16) != Z_OK){
+                        fail();
+                    }
+                    stream_open = true;
+                    stream.next_in = input.data();
+                    stream.avail_in = input.size();
+                }
+            }
+            else{
+                text.assign(input.begin(), input.end());
+                input.clear();
+            }
+        }
+        ~text_reader(){
+            if(stream_open){
+                inflateEnd(&stream);
+            }
+            if(fd >= 0){
+                close(fd);
+            }
+        }
+        text_reader(const text_reader &) = delete;
+        text_reader &operator=(const text_reader &) = delete;
+
+        bool is_open() const{
+            return fd >= 0;
+        }
+        bool is_compressed() const{
+            return format != input_format::plain;
+        }
+        // Like std::getline, false once no characters are left
+        bool getline(string &line){
+            line.clear();
+            bool extracted = false;
+            while(text_pos < text.size() || refill()){
+                size_t end = text.find('\n', text_pos);
+                if(end != string::npos){
+                    line.append(text, text_pos, end - text_pos);
+                    text_pos = end + 1;
+                    return true;
+                }
+                line.append(text, text_pos, string::npos);
+                text_pos = text.size();
+                extracted = true;
+            }
+            return extracted;
+        }
+        // Appends the next piece of text, a few MB at most, to out. false once no text is left.
+        bool read_block(string &out){
+            if(text_pos < text.size() || refill()){
+                out.append(text, text_pos, string::npos);
+                text_pos = text.size();
+                return true;
+            }
+            return false;
+        }
+        // Appends the rest of the text to out
+        void read_all(string &out){
+            while(read_block(out)){
+            }
+        }
+    };
+
+    // Dense integer ids for chromosome, gene and transcript names. Names are interned once
+    // when they are read and only looked up again for output.
+    // Safe to use from several threads; names never move once interned
+    class symbol_table{
+        std::unordered_map<std::string_view, int> ids; // views of names
+        std::deque<string> names;
+        std::atomic<size_t> sorted_prefix {0}; // ids below this were interned in increasing name order
+        mutable std::shared_mutex mutex;
+
+        public:
+        symbol_table() = default;
+        symbol_table(const symbol_table &) = delete;
+        symbol_table &operator=(const symbol_table &) = delete;
+
+        int intern(std::string_view name){
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                auto iter = ids.find(name);
+                if(iter != ids.end()){
+                    return iter->second;
+                }
+            }
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            auto iter = ids.find(name);
+            if(iter != ids.end()){
+                return iter->second;
+            }
+            int id = names.size();
+            if(sorted_prefix == names.size() && (names.empty() || std::string_view(names.back()) < name)){
+                ++sorted_prefix;
+            }
+            names.emplace_back(name);
+            ids.emplace(names.back(), id);
+            return id;
+        }
+        int find(std::string_view name) const{
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto iter = ids.find(name);
+            if(iter == ids.end()){
+                return -1;
+            }
+            return iter->second;
+        }
+        const string &name(int id) const{
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return names[id];
+        }
+        size_t size() const{
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return names.size();
+        }
+        // Orders ids by name, an integer compare when both come from the sorted prefix
+        bool less(int a, int b) const{
+            size_t prefix = sorted_prefix;
+            if(static_cast<size_t>(a) < prefix && static_cast<size_t>(b) < prefix){
+                return a < b;
+            }
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return names[a] < names[b];
+        }
+    };
+
+    symbol_table chromosome_symbols;
+    symbol_table gene_symbols;
+    symbol_table transcript_symbols;
+
+    // Genes are kept in name order wherever the order reaches the output (fusion ids, names, per gene columns)
+    struct gene_order{
+        bool operator()(int a, int b) const{
+            return gene_symbols.less(a, b);
+        }
+    };
+    using gene_set = std::set<int, gene_order>;
+    template<class V>
+    using gene_map = std::map<int, V, gene_order>;
+
+    class genomic_position{
+        public:
+        int chr;
+        int position;
+
+        genomic_position(int chr, int position) : chr(chr), position(position) {}
+        genomic_position() : chr(-1), position(-1) {}
+
+        bool operator<(const genomic_position &other) const{
+            return chr < other.chr || (chr == other.chr && position < other.position);
+        }
+        bool operator>(const genomic_position &other) const{
+            return other < *this;
+        }
+        bool operator==(const genomic_position &other) const{
+            return chr == other.chr && position == other.position;
+        }
+        template<class O>
+        friend O& operator<<(O& os, const genomic_position &lc){
+            os << chromosome_symbols.name(lc.chr) << "\t" << lc.position;
+            return os;
+        }
+    };
     enum class SEQDIR{ forward, reverse, unknown};
     cxxopts::ParseResult parse_args(int argc, char **argv ){
         try{
@@ -66,9 +674,25 @@ namespace annotate{
                                     "if larger event will be treated as an SV", cxxopts::value<double>()->default_value("0.5"))
                 ("maxrtdistance", "maximum allowed distance for a read-through event, "
                                     "if larger event will be treated as an SV", cxxopts::value<long>()->default_value("600000"))
-                ("d,duplications", "genomicSuperDups.txt, unzipped",cxxopts::value<string>())//can be found at http://hgdownload.cse.ucsc.edu/goldenpath/hg38/database/genomicSuperDups.txt.gz
+                ("d,duplications", "genomicSuperDups.txt, plain or gzip/bgzip compressed",cxxopts::value<string>())//can be found at http://hgdownload.cse.ucsc.edu/goldenpath/hg38/database/genomicSuperDups.txt.gz
                 ("r,reference", "Reference path used in filter stage",cxxopts::value<string>())
                 ("c,keep_non_coding", "Keep non coding genes", cxxopts::value<bool>()->default_value("false"))
+                ("t,threads", "Threads used for scoring and output", cxxopts::value<size_t>()->default_value("1"))
+                ("segdup-footprint", "Load only the segmental duplications overlapping the fusions' genes (ignored with --annotation-cache)", cxxopts::value<bool>()->default_value("false"))
+                ("annotation-cache", "Binary annotation cache, read if current and written otherwise", cxxopts::value<string>())
+                ("build-annotation-cache", "Only build the annotation cache from -r and -d and exit", cxxopts::value<bool>()->default_value("false"))
+                ("batch", "Manifest of samples sharing the reference, one \"input<TAB>output\" per line, replaces -i and -o", cxxopts::value<string>())
+                ("batch-jobs", "Batch samples annotated at the same time, sharing --threads", cxxopts::value<size_t>()->default_value("1"))
+                ("serve", "Keep the reference loaded and run batch manifests dropped into this directory as <name>.job, until a stop file appears", cxxopts::value<string>())
+                ("low-memory", "Keep per gene read summaries instead of alignment blocks, same output in less memory", cxxopts::value<bool>()->default_value("false"))
+                ("shard", "Sharded run, as K/N: writes the p-values of shard K to <output>/shard_K.pvalues, or with --shard-correction annotates the K-th of N ranges of fusions", cxxopts::value<string>())
+                ("shard-correction", "Corrected p-values of all shards from --merge-shards, for the output pass of --shard", cxxopts::value<string>())
+                ("merge-shards", "Comma separated shard_K.pvalues files to correct together, writes <output>/shard_correction.tsv and exits", cxxopts::value<vector<string>>())
+                ("breakpoint-clusters", "Also write breakpoint_clusters.tsv: fusion id, gene, chromosome, mode, spread and support of each breakpoint cluster", cxxopts::value<bool>()->default_value("false"))
+                ("breakpoint-window", "Largest gap between breakpoint positions of one cluster", cxxopts::value<int>()->default_value("10"))
+                ("prune-low-support", "Write fusions below --minsupport, a certain FAIL:lowsup, to pruned.tsv in the output path without annotating or scoring them", cxxopts::value<bool>()->default_value("false"))
+                ("spill-dir", "Spill read summaries to temporary files in this directory while annotating, implies --low-memory", cxxopts::value<string>())
+                ("profile", "Write stage timings and counts to profile.json in the output path", cxxopts::value<bool>()->default_value("false"))
                 ("h,help", "Prints help")
                 ;
             cxxopts::ParseResult result = options->parse(argc, argv);
@@ -78,20 +702,27 @@ namespace annotate{
                 ret |=1;
             }
 
-            if(!result.count("i")){
+            bool build_cache = result["build-annotation-cache"].as<bool>();
+            if(build_cache && !result.count("annotation-cache")){
+                std::cerr << "annotation-cache is required to build the cache" << std::endl;
+                ret |=2;
+            }
+            bool batch = result.count("batch") != 0 || result.count("serve") != 0;
+            bool merge_shards = result.count("merge-shards") != 0;
+            if(!build_cache && !batch && !merge_shards && !result.count("i")){
                 std::cerr << "input is required" << std::endl;
                 ret |=8;
             }
-            if(!result.count("o")){
+            if(!build_cache && !batch && !result.count("o")){
                 std::cerr << "output is required" << std::endl;
                 ret |=16;
             }
 
-            if(!result.count("d")){
+            if(!merge_shards && !result.count("d")){
                 std::cerr << "Duplication annotation is required" << std::endl;
                 ret |=32;
             }
-            if(!result.count("r")){
+            if(!merge_shards && !result.count("r")){
                 std::cerr << "reference is required" << std::endl;
                 ret |=64;
             }
@@ -110,49 +741,99 @@ namespace annotate{
     }
 
 //585     chr1    10000   87112   chr15:101906152 0       -       chr15   101906152       101981189       75037   11764   1000    N/A     N/A     N/A     N/A     align_both/0009/both0046049     77880   71      3611  74269   73743   526     331     195     0.992918        0.991969        0.00711601      0.00711937 
-    IITree<locus, std::tuple<string, int, int, double> > read_duplication_annotation(string path){
-        IITree<locus, std::tuple<string, int, int, double> > duplications;
+    // Keyed by (chromosome, position), data is mate chromosome, mate start, mate end and fraction matched
+    using duplication_tree = IITree<genomic_position, std::tuple<int, int, int, double> >;
+
+    // Genomic ranges, merged per chromosome, that the current fusions can query
+    class locus_footprint{
+        vector<vector<std::pair<int, int>>> ranges; // by chromosome symbol, sorted and merged after finish()
+
+        public:
+        void add(int chr, int start, int end){
+            if(chr < 0){
+                return;
+            }
+            if(static_cast<size_t>(chr) >= ranges.size()){
+                ranges.resize(chr + 1);
+            }
+            ranges[chr].emplace_back(start, end);
+        }
+        void finish(){
+            for(auto &chr_ranges : ranges){
+                std::sort(chr_ranges.begin(), chr_ranges.end());
+                vector<std::pair<int, int>> merged;
+                for(const auto &range : chr_ranges){
+                    if(!merged.empty() && range.first <= merged.back().second){
+                        merged.back().second = std::max(merged.back().second, range.second);
+                    }
+                    else{
+                        merged.push_back(range);
+                    }
+                }
+                chr_ranges.swap(merged);
+            }
+        }
+        // Closed range test, so it keeps everything the half open interval and IITree tests can match
+        bool overlaps(int chr, int start, int end) const{
+            if(chr < 0 || static_cast<size_t>(chr) >= ranges.size()){
+                return false;
+            }
+            const auto &chr_ranges = ranges[chr];
+            auto after = std::upper_bound(chr_ranges.begin(), chr_ranges.end(), std::make_pair(end, std::numeric_limits<int>::max()));
+            return after != chr_ranges.begin() && std::prev(after)->second >= start;
+        }
+    };
 
-        std::ifstream dup_file(path);
+    // With a footprint only records whose both copies lie in it are kept, as a duplication only
+    // annotates a fusion when one copy overlaps each gene interval.
+    duplication_tree read_duplication_annotation(string path, size_t thread_count = 1,
+            const locus_footprint *footprint = NULL){
+        duplication_tree duplications;
+
+        text_reader dup_file(path, thread_count);
         if(!dup_file.is_open()){
-            std::cerr << "[ERROR] Cannot open file:" << path << std::endl;
-            exit(-1);
+            throw annotate_error("Cannot open file:" + path);
         } 
         string line;
+        vector<std::string_view> fields;
         
-        string ch;
+        std::string_view ch;
         int start;
         int end;
 
-        string m_ch;
+        std::string_view m_ch;
         int m_start;
         int m_end;
 
         double frac_match;
-        while(std::getline(dup_file, line)){
-            vector<string> fields = rsplit(line,"\t");
+        while(dup_file.getline(line)){
+            split_fields(line, '\t', fields);
             ch = fields[1];
-            start = stoi(fields[2]);
-            end = stoi(fields[3]);
+            start = parse_number<int>(fields[2]);
+            end = parse_number<int>(fields[3]);
 
             m_ch = fields[7];
-            m_start = stoi(fields[8]);
-            m_end = stoi(fields[9]);
+            m_start = parse_number<int>(fields[8]);
+            m_end = parse_number<int>(fields[9]);
 
-            frac_match = stof(fields[26]);
+            frac_match = parse_number<float>(fields[26]);
 
-            if(ch.find("chr")!= string::npos){
+            if(ch.find("chr")!= std::string_view::npos){
                 ch = ch.substr(3);
             }
-            if(m_ch.find("chr")!= string::npos){
+            if(m_ch.find("chr")!= std::string_view::npos){
                 m_ch = m_ch.substr(3);
             }
-            locus s_s(ch,start);
-            locus s_e(ch,end);
+            if(footprint != NULL && (!footprint->overlaps(chromosome_symbols.find(ch), start, end) ||
+                        !footprint->overlaps(chromosome_symbols.find(m_ch), m_start, m_end))){
+                continue;
+            }
+            int chr_id = chromosome_symbols.intern(ch);
+            genomic_position s_s(chr_id,start);
+            genomic_position s_e(chr_id,end);
 //            std::cerr << m_ch << "\t" << m_start << "\t" << m_end << "\t" << s_s.chr << "\t" << s_s.position << "\t" << s_e.chr << "\t" << s_e.position << "\tDUP" << "\n";
-            duplications.add(s_s, s_e, std::make_tuple(m_ch,m_start,m_end,frac_match));
+            duplications.add(s_s, s_e, std::make_tuple(chromosome_symbols.intern(m_ch),m_start,m_end,frac_match));
         }
-        dup_file.close();
         duplications.index();
         return duplications;
     }
@@ -160,25 +841,24 @@ namespace annotate{
     class interval{
 
         public:
-        string chr;
+        int chr;
         int start;
         int end;
         bool reverse_strand;
 
-        interval( const string &chr, int start, int end, bool reverse_strand) :
+        interval( int chr, int start, int end, bool reverse_strand) :
             chr(chr),
             start(start),
             end(end),
             reverse_strand(reverse_strand) {}
-        std::pair<locus, locus> as_loci()const {
-            return std::make_pair(locus(chr,start),locus(chr,end));
+        interval( std::string_view chr, int start, int end, bool reverse_strand) :
+            interval(chromosome_symbols.intern(chr), start, end, reverse_strand) {}
+        std::pair<genomic_position, genomic_position> as_loci()const {
+            return std::make_pair(genomic_position(chr,start),genomic_position(chr,end));
         }
         
-        interval () : chr(""), start(-1), end(-1), reverse_strand(0) {}
-        
-        std::pair< locus,locus> as_loci(){
-            return std::make_pair(locus(chr,start),locus(chr,end));
-        }
+        interval () : chr(-1), start(-1), end(-1), reverse_strand(0) {}
+
         bool overlaps(const interval &other) const{
             if( chr != other.chr){
                 return false;
@@ -209,8 +889,9 @@ namespace annotate{
             }
             return true;
         }
-        friend ostream& operator<<(ostream& os, const interval &lc){
-            os  << lc.chr << ":" << lc.start << "-" << lc.end << (lc.reverse_strand?"-":"+");
+        template<class O>
+        friend O& operator<<(O& os, const interval &lc){
+            os  << chromosome_symbols.name(lc.chr) << ":" << lc.start << "-" << lc.end << (lc.reverse_strand?"-":"+");
             return os;
         }
     };
@@ -223,12 +904,12 @@ namespace annotate{
         interval range;
 
         bool reverse_strand;
-        string gene_id;
+        int gene_id;
         string gene_name;
         string gene_type;
         bool coding;
 
-        gene( interval range, const string &gene_id, const string &gene_name, 
+        gene( interval range, int gene_id, const string &gene_name, 
                 const string &gene_type) 
             : range(range),
               gene_id(gene_id),
@@ -236,7 +917,7 @@ namespace annotate{
               gene_type(gene_type),
               coding(gene_type=="protein_coding")
         {}
-        gene( interval range, const string &gene_id, const string &gene_name, 
+        gene( interval range, int gene_id, const string &gene_name, 
                 const string &gene_type, bool coding) 
             : range(range),
               gene_id(gene_id),
@@ -244,64 +925,111 @@ namespace annotate{
               gene_type(gene_type),
               coding(coding)
         {}
-        gene(){}
+        gene() : gene_id(-1), coding(false) {}
     };
 
     class exon{
         public:
         interval range;
-        string gene_id;  
-        string transcript_id;  
+        int gene_id;  
+        int transcript_id;  
         int exon_no;
 
-        exon( interval range, const string &gene_id, const string &transcript_id, int exon_no) :
+        exon( interval range, int gene_id, int transcript_id, int exon_no) :
             range(range),
             gene_id(gene_id),
             transcript_id(transcript_id),
             exon_no(exon_no) {}
-        friend ostream& operator<<(ostream& os, const exon &lc){
-            os <<  lc.gene_id << "\t"  << lc.transcript_id <<"\t"<< lc.exon_no <<"\t" << lc.range;
+        template<class O>
+        friend O& operator<<(O& os, const exon &lc){
+            os <<  gene_symbols.name(lc.gene_id) << "\t"  << transcript_symbols.name(lc.transcript_id) <<"\t"<< lc.exon_no <<"\t" << lc.range;
             return os;
         }
     };
 
-    class candidate_read{
-        public:
+    using block = std::pair<interval, exon>;
 
-        string read_id;
-        vector<std::pair<interval, exon> > blocks;
-        candidate_read(const string &rid) : read_id(rid) {}
-        candidate_read(const Candidate &cand) : read_id(cand.id){
-            for(const auto &p: cand.canonical){
-                add_block(p);
-            }
+    // Contiguous run of blocks owned by a candidate_read or a candidate_fusion
+    class block_span{
+        const block *first;
+        const block *last;
+        public:
+        block_span(const block *first, const block *last) : first(first), last(last) {}
+        const block *begin() const{
+            return first;
+        }
+        const block *end() const{
+            return last;
         }
-        vector<int> first_exons;
+        size_t size() const{
+            return last - first;
+        }
+        const block &operator[](size_t i) const{
+            return first[i];
+        }
+    };
+
+    // What scoring and output use of one gene of a read, kept instead of its blocks in low memory mode
+    class read_gene_summary{
+        public:
+        int gene_id;
+        interval range;              // the read's ranges() entry
+        genomic_position breakpoint; // get_breakpoints() entry for the read's category, forward and backward reads only
+
+        read_gene_summary(int gene_id, const interval &range, const genomic_position &breakpoint) :
+            gene_id(gene_id), range(range), breakpoint(breakpoint) {}
+        read_gene_summary() : gene_id(-1) {}
+    };
+
+    // A read as seen through its blocks, wherever they are stored, or through its gene summaries
+    // in low memory mode (blocks is then empty)
+    class read_ref{
+        const read_gene_summary *summary_first {NULL};
+        size_t summary_count {0};
 
-        auto ranges() const -> std::map<string, interval> {
-            std::map<string, interval> gene_ranges;
+        public:
+        const string &read_id;
+        block_span blocks;
+
+        read_ref(const string &read_id, block_span blocks) : read_id(read_id), blocks(blocks) {}
+        read_ref(const string &read_id, const read_gene_summary *first, size_t count) :
+            summary_first(first), summary_count(count), read_id(read_id), blocks(NULL, NULL) {}
+
+        auto ranges() const -> gene_map<interval> {
+            gene_map<interval> gene_ranges;
+            for(size_t i = 0; i < summary_count; ++i){
+                gene_ranges.emplace(summary_first[i].gene_id, summary_first[i].range);
+            }
             for(const auto &ie : blocks){
-                const string &gene_id = ie.second.gene_id;
+                int gene_id = ie.second.gene_id;
                 gene_ranges[gene_id].extend(ie.first);
             }
             return gene_ranges;
         }
-        void log(std::ofstream &ost) const{
+        template<class O>
+        void log(O &ost) const{
             ost << read_id;
             for(const auto &p: ranges()){
-                ost << "\t"<< p.first << "\t" << p.second.chr << ":" << p.second.start << "-" << p.second.end;
+                ost << "\t"<< gene_symbols.name(p.first) << "\t" << chromosome_symbols.name(p.second.chr) << ":" << p.second.start << "-" << p.second.end;
             }
             ost << "\n";
         }
 
-        std::map<string, locus> get_breakpoints(bool direction) const {
+        // Summarized reads only know the direction of their category
+        gene_map<genomic_position> get_breakpoints(bool direction) const {
             
-            std::map<string, locus> bps;
+            gene_map<genomic_position> bps;
+            if(summary_first != NULL){
+                for(size_t i = 0; i < summary_count; ++i){
+                    bps.emplace(summary_first[i].gene_id, summary_first[i].breakpoint);
+                }
+                return bps;
+            }
             
-            string first_gene = blocks[0].second.gene_id;
+            int first_gene = blocks[0].second.gene_id;
             for(auto &block : blocks){
 
-                string gene_id = block.second.gene_id;
+                int gene_id = block.second.gene_id;
                 bool is_first = (gene_id == first_gene) == direction;
 
                 bool reverse = block.first.reverse_strand;
@@ -350,23 +1078,105 @@ namespace annotate{
 
             return bps;
         }
-        void add_block(const string &line){
-            vector<string> fields = rsplit(line, "\t");
+    };
+
+    // Columns of one read's blocks that fusion_manager::add_read reduces over, in flat arrays reused from
+    // read to read, so the strand check and the per gene reductions are linear passes without node allocations
+    class read_columns{
+        public:
+        vector<int> genes;                            // by block
+        vector<uint8_t> strand_flips;                 // by block, alignment and exon strands differ
+        vector<std::pair<int, int>> gene_transcripts; // distinct (gene, transcript), sorted
+        vector<int> distinct_genes;                   // sorted by id
+        vector<int> gene_blocks;                      // blocks of each distinct gene
+
+        void assign(const vector<block> &blocks){
+            genes.resize(blocks.size());
+            strand_flips.resize(blocks.size());
+            gene_transcripts.resize(blocks.size());
+            for(size_t i = 0; i < blocks.size(); ++i){
+                const exon &ex = blocks[i].second;
+                genes[i] = ex.gene_id;
+                strand_flips[i] = ex.range.reverse_strand != blocks[i].first.reverse_strand;
+                gene_transcripts[i] = std::make_pair(ex.gene_id, ex.transcript_id);
+            }
+            std::sort(gene_transcripts.begin(), gene_transcripts.end());
+            gene_transcripts.erase(std::unique(gene_transcripts.begin(), gene_transcripts.end()), gene_transcripts.end());
+
+            distinct_genes.assign(genes.begin(), genes.end());
+            std::sort(distinct_genes.begin(), distinct_genes.end());
+            gene_blocks.clear();
+            size_t distinct = 0;
+            for(size_t i = 0; i < distinct_genes.size(); ++i){
+                if(i > 0 && distinct_genes[i] == distinct_genes[distinct - 1]){
+                    ++gene_blocks.back();
+                    continue;
+                }
+                distinct_genes[distinct++] = distinct_genes[i];
+                gene_blocks.push_back(1);
+            }
+            distinct_genes.resize(distinct);
+        }
+        // All blocks on the strand of their exon, or all on the opposite strand
+        bool consistent_strands() const{
+            size_t flips = 0;
+            for(uint8_t flip : strand_flips){
+                flips += flip;
+            }
+            return flips == 0 || flips == strand_flips.size();
+        }
+    };
+
+    // Read under construction. The first exon bookkeeping is only needed to classify the read.
+    class candidate_read{
+        public:
+
+        string read_id;
+        vector<block> blocks;
+        int first_exon_count {0};
+        int last_first_exon {-1};   // index of the last block on a first exon
+
+        candidate_read() {}
+        candidate_read(const string &rid) : read_id(rid) {}
+        candidate_read(const Candidate &cand){
+            assign(cand);
+        }
+        // Reuses the block storage of this object
+        void reset(const string &rid){
+            read_id = rid;
+            blocks.clear();
+            first_exon_count = 0;
+            last_first_exon = -1;
+        }
+        void assign(const Candidate &cand){
+            reset(cand.id);
+            for(const auto &p: cand.canonical){
+                add_block(p);
+            }
+        }
+        read_ref ref() const{
+            return read_ref(read_id, block_span(blocks.data(), blocks.data() + blocks.size()));
+        }
 
-            int start = stoi(fields[1]);
-            int end   = stoi(fields[2]);
-            string chr = fields[3];
+        void add_block(std::string_view line){
+            thread_local vector<std::string_view> fields;
+            split_fields(line, '\t', fields);
+
+            int start = parse_number<int>(fields[1]);
+            int end   = parse_number<int>(fields[2]);
+            int chr = chromosome_symbols.intern(fields[3]);
             bool reverse_strand = fields[6] == "1";
 
-            int ex_start = stoi(fields[8]);
-            int ex_end   = stoi(fields[9]);
+            int ex_start = parse_number<int>(fields[8]);
+            int ex_end   = parse_number<int>(fields[9]);
             
             bool ex_rev_strand = fields[10] == "1";
-            string gene_id  = fields[11];
-            string transcript_id = fields[12];
-            int exon_no               = stoi(fields[13]);
+            int gene_id  = gene_symbols.intern(fields[11]);
+            int transcript_id = transcript_symbols.intern(fields[12]);
+            int exon_no               = parse_number<int>(fields[13]);
             if(exon_no == 1){
-                first_exons.push_back(blocks.size());
+                ++first_exon_count;
+                last_first_exon = blocks.size();
             }
             
             
@@ -375,94 +1185,319 @@ namespace annotate{
             interval expos(chr,ex_start,ex_end, ex_rev_strand);
             exon ex(expos, gene_id, transcript_id, exon_no);
 
-            blocks.push_back(std::make_pair(alig,ex));
+            blocks.emplace_back(alig,ex);
         }
         void add_block(const std::pair<aligned_segment,::exon> &p){
 
             interval alig(p.first.chr, p.first.tmplt.start, p.first.tmplt.end, p.first.reverse_complemented);
 
             interval expos(p.second.chr, p.second.start, p.second.end, p.second.strand);
-            exon ex(expos, p.second.gene_id, p.second.transcript_id, p.second.exon_number);
+            exon ex(expos, gene_symbols.intern(p.second.gene_id), transcript_symbols.intern(p.second.transcript_id), p.second.exon_number);
             if(p.second.exon_number == 1){
-                first_exons.push_back(blocks.size());
+                ++first_exon_count;
+                last_first_exon = blocks.size();
             }
 
-            blocks.push_back(std::make_pair(alig,ex));
+            blocks.emplace_back(alig,ex);
         }
     };
 
 
-    auto median(const vector<int> &values) -> double{
-        int i = values.size() / 2;
+
+    // Read stored in a fusion, its blocks are in candidate_fusion::blocks
+    class fusion_read{
+        public:
+        string read_id;
+        uint32_t first_block;
+        uint32_t block_count;
+
+        fusion_read(string &&read_id, uint32_t first_block, uint32_t block_count) :
+            read_id(std::move(read_id)),
+            first_block(first_block),
+            block_count(block_count) {}
+    };
+
+    // Median as the ranges have always reported it: the mean of the sorted values at n/2 and n/2+1
+    // for even n, the value at n/2+1 for odd n. Positions past the end read the largest value.
+    // Found by selection, values is reordered.
+    auto median(vector<int> &values) -> double{
+        if(values.empty()){
+            return 0;
+        }
+        size_t i = values.size() / 2;
+        size_t last = values.size() - 1;
         if(values.size() % 2 == 0){
-            return values[i] / 2.0 + values[i + 1] / 2.0;
+            std::nth_element(values.begin(), values.begin() + i, values.end());
+            int next = i < last ? *std::min_element(values.begin() + i + 1, values.end()) : values[i];
+            return values[i] / 2.0 + next / 2.0;
         }
         else{
-            return values[i + 1];
+            size_t k = std::min(i + 1, last);
+            std::nth_element(values.begin(), values.begin() + k, values.end());
+            return values[k];
         }
     }
 
-    class candidate_fusion{
+    enum class read_category{ forward, backward, no_first, multi_first};
 
-        public:
-        std::map<string,double> non_covered_sum_ratio;
+    // Non-owning range over the reads of one or more categories of a fusion, in the order given.
+    // With summaries, fusion_read offsets index the summaries instead of the blocks.
+    class read_view{
+        const vector<block> *blocks;
+        const vector<read_gene_summary> *summaries;
+        std::array<const vector<fusion_read> *, 4> parts;
+        size_t part_count;
 
-        string name;
-        string id;
-        vector<candidate_read> forward;
-        vector<candidate_read> backward;
+        public:
+        class iterator{
+            const read_view *view;
+            size_t part;
+            size_t index;
+            void skip_empty(){
+                while(part < view->part_count && index == view->parts[part]->size()){
+                    ++part;
+                    index = 0;
+                }
+            }
+            public:
+            iterator(const read_view *view, size_t part) : view(view), part(part), index(0) {
+                skip_empty();
+            }
+            read_ref operator*() const{
+                const fusion_read &fr = (*view->parts[part])[index];
+                if(view->summaries != NULL){
+                    return read_ref(fr.read_id, view->summaries->data() + fr.first_block, fr.block_count);
+                }
+                const block *first = view->blocks->data() + fr.first_block;
+                return read_ref(fr.read_id, block_span(first, first + fr.block_count));
+            }
+            iterator &operator++(){
+                ++index;
+                skip_empty();
+                return *this;
+            }
+            bool operator==(const iterator &other) const{
+                return part == other.part && index == other.index;
+            }
+            bool operator!=(const iterator &other) const{
+                return !(*this == other);
+            }
+        };
 
-        vector<candidate_read> no_first;
-        vector<candidate_read> multi_first;
+        read_view(const vector<block> *blocks, const vector<read_gene_summary> *summaries = NULL) :
+            blocks(blocks), summaries(summaries), part_count(0) {}
+        read_view(const vector<block> *blocks, const vector<read_gene_summary> *summaries,
+                std::initializer_list<const vector<fusion_read> *> vectors) :
+            blocks(blocks), summaries(summaries), part_count(0){
+            for(const auto *v : vectors){
+                append(v);
+            }
+        }
+        void append(const vector<fusion_read> *v){
+            assert(part_count < parts.size());
+            parts[part_count++] = v;
+        }
+        iterator begin() const{
+            return iterator(this, 0);
+        }
+        iterator end() const{
+            return iterator(this, part_count);
+        }
+        size_t size() const{
+            size_t total = 0;
+            for(size_t i = 0; i < part_count; ++i){
+                total += parts[i]->size();
+            }
+            return total;
+        }
+        bool empty() const{
+            return begin() == end();
+        }
+    };
+
+    // Breakpoint positions of one gene of a fusion's forward and backward reads, grouped into clusters on output
+    class breakpoint_histogram{
+        public:
+        int chr {-1};
+        vector<std::pair<int, uint32_t>> counts; // position and reads, sorted by position
+
+        void add(const genomic_position &bp, uint32_t reads = 1){
+            chr = bp.chr;
+            auto iter = std::lower_bound(counts.begin(), counts.end(), std::make_pair(bp.position, uint32_t(0)));
+            if(iter != counts.end() && iter->first == bp.position){
+                iter->second += reads;
+            }
+            else{
+                counts.insert(iter, std::make_pair(bp.position, reads));
+            }
+        }
+        void merge(const breakpoint_histogram &other){
+            for(const auto &position_reads : other.counts){
+                add(genomic_position(other.chr, position_reads.first), position_reads.second);
+            }
+        }
+
+        // Run of positions no more than window apart: its most supported position (the leftmost of ties),
+        // last minus first position and reads
+        struct cluster{
+            int mode;
+            int spread;
+            uint32_t support;
+        };
+        vector<cluster> clusters(int window) const{
+            vector<cluster> found;
+            int first = 0;
+            uint32_t mode_reads = 0;
+            for(size_t i = 0; i < counts.size(); ++i){
+                if(i == 0 || counts[i].first - counts[i - 1].first > window){
+                    found.push_back(cluster{counts[i].first, 0, 0});
+                    first = counts[i].first;
+                    mode_reads = 0;
+                }
+                cluster &current = found.back();
+                current.spread = counts[i].first - first;
+                current.support += counts[i].second;
+                if(counts[i].second > mode_reads){
+                    current.mode = counts[i].first;
+                    mode_reads = counts[i].second;
+                }
+            }
+            return found;
+        }
+    };
+
+    class candidate_fusion{
+
+        public:
+        std::map<int,double> non_covered_sum_ratio;
+
+        string name;
+        string id;
+        vector<int> genes; // in name order, as in id
+        vector<block> blocks; // blocks of all reads below, in arrival order
+        vector<fusion_read> forward;
+        vector<fusion_read> backward;
+
+        vector<fusion_read> no_first;
+        vector<fusion_read> multi_first;
 
         vector<std::pair<interval, interval> > duplications;
         vector<std::pair<gene, gene> > gene_overlaps;
         int invalid {0};
+        gene_map<breakpoint_histogram> breakpoint_histograms; // only collected on request, see fusion_manager
+
+        // Low memory mode (see fusion_manager): blocks stays empty and each read keeps one summary per gene,
+        // the gene extents are folded in as reads arrive, and only the first read of each category keeps its blocks
+        bool summarized {false};
+        vector<read_gene_summary> summaries;
+        gene_map<interval> extents;
+        std::array<vector<block>, 4> first_read_blocks; // by read_category
+        // Spill mode: reads of each category written to the spill files instead of the vectors above
+        std::array<uint32_t, 4> spilled_reads {};
+        // Left out of annotation and scoring as a certain FAIL:lowsup, see fusion_manager::prune_low_support
+        bool pruned {false};
+
+        // One block's step of fusion_gene_intervals: leftmost start and rightmost end of each gene,
+        // the chromosome and strand of its latest block
+        static void fold_extent(gene_map<interval> &gene_extents, int gene_id, const interval &i){
+            auto inserted = gene_extents.emplace(gene_id, interval(i.chr, i.start, std::max(i.end, 0), i.reverse_strand));
+            if(inserted.second){
+                return;
+            }
+            interval &extent = inserted.first->second;
+            if(i.start < extent.start || extent.start == 0){
+                extent.start = i.start;
+            }
+            if(i.end > extent.end){
+                extent.end = i.end;
+            }
+            extent.chr = i.chr;
+            extent.reverse_strand = i.reverse_strand;
+        }
 
 
-        void log(std::ofstream &ost) const {
-
-            for(const candidate_read &cr : forward){
-                cr.log(ost);
+        const vector<fusion_read> &reads(read_category category) const{
+            switch(category){
+                case read_category::forward:
+                    return forward;
+                case read_category::backward:
+                    return backward;
+                case read_category::no_first:
+                    return no_first;
+                case read_category::multi_first:
+                default:
+                    return multi_first;
             }
-            for(const candidate_read &cr : backward){
-                cr.log(ost);
+        }
+        vector<fusion_read> &reads(read_category category){
+            return const_cast<vector<fusion_read> &>(static_cast<const candidate_fusion &>(*this).reads(category));
+        }
+        read_view reads(std::initializer_list<read_category> categories) const{
+            read_view view(&blocks, summarized ? &summaries : NULL);
+            for(read_category category : categories){
+                view.append(&reads(category));
             }
-            for(const candidate_read &cr : no_first){
-                cr.log(ost);
+            return view;
+        }
+        // forward, backward, no_first, multi_first
+        read_view all_reads() const{
+            return read_view(&blocks, summarized ? &summaries : NULL, {&forward, &backward, &no_first, &multi_first});
+        }
+        // Reads of category, including the spilled ones
+        size_t read_count(read_category category) const{
+            return reads(category).size() + spilled_reads[static_cast<size_t>(category)];
+        }
+        // Reads that count against min_support: forward, backward and multi_first
+        size_t support_count() const{
+            return read_count(read_category::forward) + read_count(read_category::backward)
+                + read_count(read_category::multi_first);
+        }
+        // Blocks of the read is_cluster_rt looks at, the first of forward, backward, multi_first, no_first
+        block_span representative_blocks() const{
+            for(read_category category : {read_category::forward, read_category::backward,
+                    read_category::multi_first, read_category::no_first}){
+                if(read_count(category) == 0){
+                    continue;
+                }
+                if(summarized){
+                    const vector<block> &first = first_read_blocks[static_cast<size_t>(category)];
+                    return block_span(first.data(), first.data() + first.size());
+                }
+                return (*reads({category}).begin()).blocks;
+            }
+            return block_span(NULL, NULL);
+        }
+        // Appends a read's gene summaries to out, folds in its gene extents and keeps its blocks if it is
+        // the first read of its category. The caller then adds the read to reads(category) or spills it.
+        // bps are get_breakpoints of forward and backward reads, empty for the others.
+        void summarize(const read_ref &read, read_category category, const gene_map<genomic_position> &bps,
+                vector<read_gene_summary> &out){
+            if(read_count(category) == 0){
+                first_read_blocks[static_cast<size_t>(category)].assign(read.blocks.begin(), read.blocks.end());
+            }
+            for(const auto &gene_range : read.ranges()){
+                auto bp = bps.find(gene_range.first);
+                out.emplace_back(gene_range.first, gene_range.second, bp != bps.end() ? bp->second : genomic_position());
             }
-            for(const candidate_read &cr : multi_first){
+            for(const auto &i_e : read.blocks){
+                fold_extent(extents, i_e.second.gene_id, i_e.first);
+            }
+        }
+
+        template<class O>
+        void log(O &ost) const {
+
+            for(const read_ref &cr : all_reads()){
                 cr.log(ost);
             }
         }
 
         auto median_range() const -> vector<std::tuple<string, int, int>>{
             vector<std::tuple<string, int, int>> median_values;
-            std::map<string, vector< int>> begins;
-            std::map<string, vector< int>> ends;
-            std::map<string, string> chrs;
-            for(const candidate_read &cr : forward){
-                for( const auto &pp: cr.ranges()){
-                    begins[pp.first].push_back(pp.second.start);
-                    ends[pp.first].push_back(pp.second.end);
-                    chrs[pp.first] = pp.second.chr;
-                }
-            }
-            for(const candidate_read &cr : backward){
-                for( const auto &pp: cr.ranges()){
-                    begins[pp.first].push_back(pp.second.start);
-                    ends[pp.first].push_back(pp.second.end);
-                    chrs[pp.first] = pp.second.chr;
-                }
-            }
-            for(const candidate_read &cr : no_first){
-                for( const auto &pp: cr.ranges()){
-                    begins[pp.first].push_back(pp.second.start);
-                    ends[pp.first].push_back(pp.second.end);
-                    chrs[pp.first] = pp.second.chr;
-                }
-            }
-            for(const candidate_read &cr : multi_first){
+            gene_map<vector< int>> begins;
+            std::map<int, vector< int>> ends;
+            std::map<int, int> chrs;
+            for(const read_ref &cr : all_reads()){
                 for( const auto &pp: cr.ranges()){
                     begins[pp.first].push_back(pp.second.start);
                     ends[pp.first].push_back(pp.second.end);
@@ -474,51 +1509,67 @@ namespace annotate{
                 const auto &gn = pp.first;
                 auto &bvec = pp.second;
                 auto &evec = ends[gn];
-                const string &chr = chrs[gn];
-                sort(bvec.begin(), bvec.end());
-                sort(evec.begin(), evec.end());
+                const string &chr = chromosome_symbols.name(chrs[gn]);
                 median_values.emplace_back(chr, median(bvec), median(evec));
             }
             return median_values;
         }
         size_t total_count() const {
-            return forward.size() 
-                + backward.size() 
-                + multi_first.size() 
-                + no_first.size();
-        }
-        std::map<string, interval> fusion_gene_intervals(){
-            std::map<string, string> chrs;
-            std::map<string, int> mins; 
-            std::map<string, int> maxs;
-            std::map<string, bool> rev;
-            for(const auto &v : {forward, backward, no_first, multi_first}){
-                for(const auto &c : v){
-                    for(const auto &i_e : c.blocks){
-                        const interval &i = i_e.first;
-                        const exon &e = i_e.second;
-                        int mn = mins[e.gene_id];
-                        int mx = maxs[e.gene_id];
-                        if(i.start < mn || mn == 0){
-                            mins[e.gene_id] = i.start;
-                        }
-                        if(i.end > mx){
-                            maxs[e.gene_id] = i.end;
-                        }
-                        chrs[e.gene_id] = i.chr;
-                        rev[e.gene_id] = i.reverse_strand;
+            return read_count(read_category::forward)
+                + read_count(read_category::backward)
+                + read_count(read_category::multi_first)
+                + read_count(read_category::no_first);
+        }
+        // Takes the reads of other as if they had been added after the reads of this fusion
+        void merge(candidate_fusion &&other){
+            for(const auto &gene_ratio : other.non_covered_sum_ratio){
+                non_covered_sum_ratio[gene_ratio.first] += gene_ratio.second;
+            }
+            uint32_t block_offset = summarized ? summaries.size() : blocks.size();
+            blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+            summaries.insert(summaries.end(), other.summaries.begin(), other.summaries.end());
+            for(const auto &gene_extent : other.extents){
+                auto inserted = extents.emplace(gene_extent);
+                interval &extent = inserted.first->second;
+                const interval &later = gene_extent.second;
+                if(!inserted.second){
+                    if(later.start < extent.start || extent.start == 0){
+                        extent.start = later.start;
                     }
+                    extent.end = std::max(extent.end, later.end);
+                    extent.chr = later.chr;
+                    extent.reverse_strand = later.reverse_strand;
                 }
-            } 
-            std::map<string, interval> ivals;
-            for(const auto &k_v : mins){
-                const string &key = k_v.first;
-                const int &mn = k_v.second;
-                const int &mx = maxs[key];
-                const string &chr = chrs[key];
-                bool rs = rev[key];
-                ivals.emplace(key, interval{chr,mn,mx,rs});
             }
+            for(read_category category : {read_category::forward, read_category::backward,
+                    read_category::no_first, read_category::multi_first}){
+                vector<fusion_read> &mine = reads(category);
+                if(read_count(category) == 0){
+                    first_read_blocks[static_cast<size_t>(category)] = std::move(other.first_read_blocks[static_cast<size_t>(category)]);
+                }
+                spilled_reads[static_cast<size_t>(category)] += other.spilled_reads[static_cast<size_t>(category)];
+                for(fusion_read &read : other.reads(category)){
+                    read.first_block += block_offset;
+                    mine.push_back(std::move(read));
+                }
+            }
+            for(const auto &gene_histogram : other.breakpoint_histograms){
+                breakpoint_histograms[gene_histogram.first].merge(gene_histogram.second);
+            }
+            duplications.insert(duplications.end(), other.duplications.begin(), other.duplications.end());
+            gene_overlaps.insert(gene_overlaps.end(), other.gene_overlaps.begin(), other.gene_overlaps.end());
+            invalid += other.invalid;
+        }
+        gene_map<interval> fusion_gene_intervals() const{
+            if(summarized){
+                return extents;
+            }
+            gene_map<interval> ivals;
+            for(const read_ref &c : all_reads()){
+                for(const auto &i_e : c.blocks){
+                    fold_extent(ivals, i_e.second.gene_id, i_e.first);
+                }
+            } 
             return ivals;
         }
 
@@ -526,321 +1577,1164 @@ namespace annotate{
         candidate_fusion() {}
     };
 
-    auto dash_fold(const string &a, const string &b){
-        return std::move(a) + "::" + b;
+    // g.gene_id is left unset, the caller interns gene_id once it knows the gene is new
+    bool make_gene(const vector<std::string_view> &tabs, gene &g, string &gene_id){
+        if(tabs[2] != "gene"){
+            return false;
+        }
+        interval range( tabs[0], parse_number<int>(tabs[3]), parse_number<int>(tabs[4]), tabs[6]=="-");
+        std::string_view value;
+
+        if(gtf_attribute(tabs[8], "gene_id", value)){
+            gene_id = strip_version(value);
+        }
+        string gene_name, gene_type;
+        if(gtf_attribute(tabs[8], "gene_name", value)){
+            gene_name = value;
+        }
+        if(gtf_attribute(tabs[8], "gene_biotype", value) || gtf_attribute(tabs[8], "gene_type", value)){
+            gene_type = value;
+        }
+   //     std::cerr << gene_type << "\tTYPE\n";
+        g = gene(range, -1, gene_name, gene_type);
+        return true;
     }
-    class fusion_manager{
+
+// Gene table, transcript exon counts and (on request) last exon numbers,
+// built from a single streaming pass over the GTF. Tables are indexed by symbol id.
+    class gtf_index{
         public:
-        std::map<string, candidate_fusion> fusions;
-        std::map<string, int> gene_counts;
+        vector<gene> genes;                 // gene_id is -1 for symbols that are not annotated genes
+        vector<int> transcript_exon_counts;
+        vector<int> last_exons;             // transcript to last exon number, only filled if asked for
+        bool has_last_exons;
+        // Keys of the gene pairs whose ranges overlap, first gene in name order, see index_gene_overlaps
+        std::unordered_set<uint64_t> overlapping_genes;
+
+        static uint64_t gene_pair_key(int first, int second){
+            return (static_cast<uint64_t>(static_cast<uint32_t>(first)) << 32) | static_cast<uint32_t>(second);
+        }
 
-        fusion_manager( const vector<Candidate> &candidates, const std::unordered_map<string, gene> &gene_annot,
-            const std::unordered_map<string, int> &exon_counts){
-            for( auto &cand : candidates){
+        gtf_index(const string &gtf_path, bool build_last_exons = false, size_t thread_count = 1) :
+                has_last_exons(build_last_exons){
+            text_reader gtf_file(gtf_path, thread_count);
+            if(!gtf_file.is_open()){
+                std::cerr << "[ERROR] Cannot open file:" << gtf_path << std::endl;
+                exit(-1);
+            } 
 
-                add_read(candidate_read{cand}, gene_annot, exon_counts);
+            vector<std::pair<string, gene>> parsed_genes;
+            string line;
+            vector<std::string_view> tabs;
+            while(gtf_file.getline(line)){
+                if(line.empty() || line[0]=='#'){ //Comment
+                    continue;
+                }
+                split_fields(line, '\t', tabs);
+                if(tabs[2] == "gene"){
+                    parsed_genes.emplace_back();
+                    make_gene(tabs, parsed_genes.back().second, parsed_genes.back().first);
+                }
+                else if(tabs[2] == "exon"){
+                    add_exon(tabs);
+                }
             }
-
+            add_genes(parsed_genes);
+            index_gene_overlaps();
         }
-        fusion_manager() {}
-        void add_read(const candidate_read &read, const std::unordered_map<string, gene> &gene_annot,
-            const std::unordered_map<string, int> &exon_counts){
-
-
-            std::set<string> gene_ids;
-            std::map<string,int> gene_order;   //use
-            std::map<string, std::unordered_set<string>> transcript_ids;
-            std::map<string, double> approximate_coverage;
-            int and_all_blocks  = 1;
-            int not_and_all_blocks = 1;
-            int index = 0;
-            for(auto i_and_e : read.blocks){
-                auto ite = gene_ids.find(i_and_e.second.gene_id);
-                if(ite == gene_ids.end()){
-                    gene_order[i_and_e.second.gene_id] = index;
-                    ++index;
-                }
-                gene_ids.insert(i_and_e.second.gene_id);
-                
-                bool exon_strand = i_and_e.second.range.reverse_strand;
-                bool interval_strand = i_and_e.first.reverse_strand;
-
-                int strand_xor = exon_strand ^ interval_strand;
-
-                and_all_blocks = and_all_blocks && strand_xor;
-                not_and_all_blocks = not_and_all_blocks && (! strand_xor);
-
-                
-                if(gene_annot.find(i_and_e.second.gene_id) == gene_annot.end()){
-                    std::cerr << i_and_e.second.gene_id << " is not in annotation!\n";
+        gtf_index() : has_last_exons(false) {}
+
+        // Finds the overlapping gene pairs once, by a sweep over the genes in chromosome and start order,
+        // so that annotating a fusion's gene pair is a single probe
+        void index_gene_overlaps(){
+            vector<const gene *> by_start;
+            for(const gene &g : genes){
+                if(g.gene_id != -1){
+                    by_start.push_back(&g);
                 }
-                //int exon_count = exon_counts.at(i_and_e.second.transcript_id);
-                transcript_ids[i_and_e.second.gene_id].insert(i_and_e.second.transcript_id);
-                approximate_coverage[i_and_e.second.gene_id] += 1;//(1.0/exon_count);
             }
-            
-
-            string fusion_name = "";
-            for(const string &id : gene_ids){
-                fusion_name += gene_annot.find(id)->second.gene_name + "::";
+            std::sort(by_start.begin(), by_start.end(), [] (const gene *a, const gene *b) {
+                return a->range.chr < b->range.chr || (a->range.chr == b->range.chr && a->range.start < b->range.start);
+            });
+            overlapping_genes.clear();
+            gene_order name_order;
+            for(size_t i = 0; i < by_start.size(); ++i){
+                const interval &left = by_start[i]->range;
+                for(size_t j = i + 1; j < by_start.size(); ++j){
+                    const interval &right = by_start[j]->range;
+                    if(right.chr != left.chr || (right.start >= left.end && right.start != left.start)){
+                        break;
+                    }
+                    const gene *first = by_start[i];
+                    const gene *second = by_start[j];
+                    if(name_order(second->gene_id, first->gene_id)){
+                        std::swap(first, second);
+                    }
+                    if(first->range.overlaps(second->range)){
+                        overlapping_genes.insert(gene_pair_key(first->gene_id, second->gene_id));
+                    }
+                }
             }
+        }
+        // Same as first->range.overlaps(second->range) for annotated genes, first before second in name order
+        bool genes_overlap(int first, int second) const{
+            return overlapping_genes.count(gene_pair_key(first, second)) != 0;
+        }
 
-            fusion_name.pop_back();
-            fusion_name.pop_back();
-
-            string fusion_id = std::accumulate( std::next(std::begin(gene_ids)), std::end(gene_ids), *(std::begin(gene_ids)), dash_fold);
-
-            for( string gid : gene_ids){
-                gene_counts[gid]+=1;
+        // Interns the genes in name order so gene_order compares ints. The first record of an id wins.
+        void add_genes(vector<std::pair<string, gene>> &parsed_genes){
+            std::stable_sort(parsed_genes.begin(), parsed_genes.end(),
+                [] (const std::pair<string, gene> &a, const std::pair<string, gene> &b) {
+                    return a.first < b.first;
+                });
+            for(auto &id_gene : parsed_genes){
+                int gid = gene_symbols.intern(id_gene.first);
+                if(static_cast<size_t>(gid) >= genes.size()){
+                    genes.resize(gid + 1);
+                }
+                if(genes[gid].gene_id == -1){
+                    genes[gid] = std::move(id_gene.second);
+                    genes[gid].gene_id = gid;
+                }
             }
-            auto &cand = fusions[fusion_id];
-            if( !(and_all_blocks || not_and_all_blocks)){
-                //Invalid Strand configuration
-                //std::cerr << read.read_id << "\n";
-                //for(const string &id : gene_ids){
-                //    std::cerr << id<< "::";
-               // }
-                cand.invalid +=1;
+        }
+        const gene *find_gene(int gene_id) const{
+            if(gene_id < 0 || static_cast<size_t>(gene_id) >= genes.size() || genes[gene_id].gene_id == -1){
+                return NULL;
             }
+            return &genes[gene_id];
+        }
+        // Throws std::out_of_range for transcripts without exons in the annotation
+        int exon_count(int transcript_id) const{
+            return transcript_exon_counts.at(transcript_id);
+        }
+        void set_exon_count(int transcript_id, int count){
+            if(static_cast<size_t>(transcript_id) >= transcript_exon_counts.size()){
+                transcript_exon_counts.resize(transcript_id + 1, 0);
+            }
+            transcript_exon_counts[transcript_id] = count;
+        }
 
-            for( string gid : gene_ids){
-                int max_exon_count = 1;
-                for(string tid : transcript_ids[gid]){
-                    int exon_count = exon_counts.at(tid);
-
-                    if( max_exon_count < exon_count){
-                        max_exon_count = exon_count;
-                    }
+        private:
+        void add_exon(const vector<std::string_view> &tabs){
+            int transcript_id = -1;
+            int exon_number = -1;
+            std::string_view value;
+            if(gtf_attribute(tabs[8], "transcript_id", value)){
+                transcript_id = transcript_symbols.intern(strip_version(value));
+                if(static_cast<size_t>(transcript_id) >= transcript_exon_counts.size()){
+                    transcript_exon_counts.resize(transcript_id + 1, 0);
                 }
-                //std::cerr << gid << "\t" << max_exon_count << "\t" << approximate_coverage[gid] << "\n";
-                cand.non_covered_sum_ratio[gid]+= 10.0 / (10 + max_exon_count - approximate_coverage[gid]);
+                transcript_exon_counts[transcript_id]+=1;
             }
-                
-            cand.name = fusion_name;
-            cand.id = fusion_id;
-            int last_first = - 1;
-            if(read.first_exons.size() > 1){
-                cand.multi_first.push_back(read);
-                return;
+            if(has_last_exons && gtf_attribute(tabs[8], "exon_number", value)){
+                exon_number = parse_number<int>(value);
             }
-            if(read.first_exons.size() == 0){
-                cand.no_first.push_back(read);
+            if(!has_last_exons){
                 return;
             }
-            last_first = read.first_exons.back();
-            if(read.blocks[last_first].second.gene_id == *(gene_ids.rbegin())){
-                cand.forward.push_back(read);
+            if( transcript_id == -1){
+                std::cerr << "Transcript doesn't have transcript_id\n";
+                transcript_id = transcript_symbols.intern("-1");
+            }
+            if(static_cast<size_t>(transcript_id) >= last_exons.size()){
+                last_exons.resize(transcript_id + 1, 0);
             }
-            else{
-                cand.backward.push_back(read);
+            if( exon_number > last_exons[transcript_id]){
+                last_exons[transcript_id] = exon_number;
             }
         }
     };
 
-    bool make_gene(const string &line, gene &g){
-        vector<string> tabs = rsplit(line, "\t");
-        string ch(tabs[0]);
-        if(ch.find("chr")!=string::npos){
-            ch = ch.substr(3);
+    auto dash_fold(const string &a, const string &b){
+        return std::move(a) + "::" + b;
+    }
+    // Spill mode: unlinked temporary file in directory, holding reads spilled to disk until it is closed
+    class spill_file{
+        FILE *file;
+
+        public:
+        explicit spill_file(const string &directory){
+            string path = directory + "/genion_spill_XXXXXX";
+            int fd = mkstemp(&path[0]);
+            file = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+            if(file == NULL){
+                throw annotate_error("Cannot open file: " + path);
+            }
+            unlink(path.c_str());
         }
-        interval range( tabs[0], stoi(tabs[3]), stoi(tabs[4]), tabs[6]=="-");
-        if(tabs[2] != "gene"){
-            return false;
+        spill_file(const spill_file &) = delete;
+        spill_file &operator=(const spill_file &) = delete;
+        ~spill_file(){
+            fclose(file);
+        }
+        void write(const void *data, size_t size){
+            if(size > 0 && fwrite(data, 1, size, file) != size){
+                throw annotate_error("Cannot write spill file, is the spill directory full?");
+            }
         }
-        vector<string> fields = rsplit(tabs[8], ";");
-        string gene_id, gene_name, gene_type;
+        bool read(void *data, size_t size){
+            return size == 0 || fread(data, 1, size, file) == size;
+        }
+        // Back to the first record, for reading what was written
+        void rewind(){
+            std::fflush(file);
+            std::rewind(file);
+        }
+    };
+
+    // A read as spill files store it: the fusion it belongs to, its category, id and gene summaries.
+    // Writer and reader are the same process, so summaries are stored as they are in memory.
+    class spilled_read{
+        static_assert(std::is_trivially_copyable<read_gene_summary>::value, "summaries are spilled as raw bytes");
+
+        public:
+        uint32_t fusion;
+        read_category category;
+        string read_id;
+        vector<read_gene_summary> summaries;
+
+        void write(spill_file &file) const{
+            uint32_t header[4] = {fusion, static_cast<uint32_t>(category),
+                static_cast<uint32_t>(read_id.size()), static_cast<uint32_t>(summaries.size())};
+            file.write(header, sizeof(header));
+            file.write(read_id.data(), read_id.size());
+            file.write(summaries.data(), summaries.size() * sizeof(read_gene_summary));
+        }
+        // False at the end of the file
+        bool read(spill_file &file){
+            uint32_t header[4];
+            if(!file.read(header, sizeof(header))){
+                return false;
+            }
+            fusion = header[0];
+            category = static_cast<read_category>(header[1]);
+            read_id.resize(header[2]);
+            summaries.resize(header[3]);
+            return file.read(&read_id[0], read_id.size())
+                && file.read(summaries.data(), summaries.size() * sizeof(read_gene_summary));
+        }
+    };
 
-        for(auto iter = fields.begin(); iter != fields.end(); iter++){
+    // Integer key of a fusion's gene set. Gene pairs (and single genes) pack their gene symbols,
+    // larger gene sets get a key with an empty upper half from fusion_manager's gene set table.
+    using fusion_key = uint64_t;
 
-            if( iter->find("gene_id") != string::npos){
-                string _id = iter->substr(iter->find("d ")+3);
-                _id.pop_back();
-                if( _id.find(".") != string::npos){
-                    size_t dot_pos = _id.find(".");
-                    _id = _id.substr(0,dot_pos);
+    class fusion_manager{
+        std::unordered_map<fusion_key, size_t> fusion_index; // into fusions
+        std::map<vector<int>, uint32_t> gene_set_keys; // for fusions of more than two genes
+
+        template<class Genes> // gene_set or a vector in name order
+        fusion_key key_of(const Genes &gene_ids){
+            if(gene_ids.size() <= 2){
+                uint64_t first = *gene_ids.begin();
+                uint64_t second = gene_ids.size() == 2 ? *gene_ids.rbegin() + 1 : 0;
+                return ((first + 1) << 32) | second;
+            }
+            vector<int> genes(gene_ids.begin(), gene_ids.end());
+            auto iter = gene_set_keys.emplace(std::move(genes), gene_set_keys.size() + 1).first;
+            return iter->second;
+        }
+        bool summarize_reads {false};
+
+        string spill_directory; // spill mode if set
+        std::unique_ptr<spill_file> spill; // spilled reads in arrival order, numbered by index in fusions
+        vector<std::unique_ptr<spill_file>> bucket_files; // spilled reads by range of sorted fusions, see for_each_read_range
+        vector<size_t> bucket_starts;
+        spilled_read spill_record; // reused by add_read
+        read_columns columns;      // reused by add_read
+        bool collect_breakpoints {false}; // fill the fusions' breakpoint_histograms
+        vector<int> named_genes;   // reused by add_read
+        // Fusions whose id keep_fusion rejects are not kept, their reads still count for their genes
+        std::function<bool(const string &)> keep_fusion;
+        static constexpr size_t not_kept = std::numeric_limits<size_t>::max(); // fusion_index of those
+
+        // Moves the spilled reads into one bucket file per range of order holding up to bucket_reads reads
+        // (or a single fusion), numbered by their position in order and still in arrival order
+        void fill_buckets(const vector<const candidate_fusion *> &order, size_t bucket_reads){
+            vector<uint32_t> position(fusions.size());
+            vector<uint32_t> bucket(fusions.size());
+            bucket_starts.assign(1, 0);
+            size_t bucket_size = 0;
+            for(size_t i = 0; i < order.size(); ++i){
+                size_t reads = order[i]->total_count();
+                if(bucket_size > 0 && bucket_size + reads > bucket_reads){
+                    bucket_starts.push_back(i);
+                    bucket_size = 0;
                 }
-                gene_id = _id;
-            } 
+                bucket_size += reads;
+                position[order[i] - fusions.data()] = i;
+                bucket[order[i] - fusions.data()] = bucket_starts.size() - 1;
+            }
+            bucket_starts.push_back(order.size());
+            for(size_t b = 0; b + 1 < bucket_starts.size(); ++b){
+                bucket_files.push_back(std::make_unique<spill_file>(spill_directory));
+            }
+            spill->rewind();
+            while(spill_record.read(*spill)){
+                uint32_t index = spill_record.fusion;
+                spill_record.fusion = position[index];
+                spill_record.write(*bucket_files[bucket[index]]);
+            }
+            spill.reset();
+        }
+        void spill_read(){
+            if(spill == NULL){
+                spill = std::make_unique<spill_file>(spill_directory);
+            }
+            spill_record.write(*spill);
+        }
 
-            if( iter->find("gene_name") != string::npos){
-                string _id = iter->substr(iter->find("e ")+3);
-                _id.pop_back();
-                gene_name = _id;
+        public:
+        vector<candidate_fusion> fusions; // in insertion order, see sorted_fusions
+        vector<int> gene_counts; // by gene symbol
+
+        // Fusions in fusion id order, for indexed (and parallel) passes over them
+        vector<const candidate_fusion *> sorted_fusions() const{
+            vector<const candidate_fusion *> sorted;
+            sorted.reserve(fusions.size());
+            for(const auto &fusion : fusions){
+                sorted.push_back(&fusion);
             }
-            if( iter->find("gene_biotype") != string::npos ||
-                iter->find("gene_type") != string::npos 
-              ){
-                string _id = iter->substr(iter->find("e ")+3);
-                _id.pop_back();
-                gene_type = _id;
+            std::sort(sorted.begin(), sorted.end(), [] (const candidate_fusion *a, const candidate_fusion *b) {
+                return a->id < b->id;
+            });
+            return sorted;
+        }
+        // Number of reads that touch gene
+        int gene_count(int gene) const{
+            return gene >= 0 && static_cast<size_t>(gene) < gene_counts.size() ? gene_counts[gene] : 0;
+        }
+        // Marks the fusions with fewer than min_support supporting reads, which score_fusion always fails
+        // as lowsup, as pruned. They keep their reads and gene counts, so they are still tested and other
+        // fusions' scores do not change, but duplication and overlap annotation skip them and
+        // classify_fusions writes a short summary instead of scoring them. Returns the number pruned.
+        size_t prune_low_support(size_t min_support){
+            size_t count = 0;
+            for(candidate_fusion &fusion : fusions){
+                fusion.pruned = fusion.support_count() < min_support;
+                count += fusion.pruned;
             }
+            return count;
         }
-   //     std::cerr << gene_type << "\tTYPE\n";
-        g = gene(range, gene_id, gene_name, gene_type);
-        return true;
-    }
 
-// umap of transcript to last exon id
-    std::unordered_map<string, int> read_last_exons(string gtf_path){
-        std::ifstream gtf_file(gtf_path);
-        if(!gtf_file.is_open()){
-            std::cerr << "[ERROR] Cannot open file:" << gtf_path << std::endl;
-            exit(-1);
-        } 
+        // With summarize_reads (low memory mode) reads are folded into per gene summaries as they are added
+        // and their blocks dropped. With a spill_directory (spill mode, implies summarize_reads) the summaries
+        // and read ids go to temporary files there and fusions keep their read counts only.
+        // Scores and outputs are the same.
+        fusion_manager( const vector<Candidate> &candidates, const gtf_index &annotation, bool summarize_reads = false,
+                const string &spill_directory = "") :
+                summarize_reads(summarize_reads || spill_directory != ""), spill_directory(spill_directory){
+            candidate_read read;
+            for( auto &cand : candidates){
+                read.assign(cand);
+                add_read(std::move(read), annotation);
+            }
 
+        }
+        fusion_manager() {}
+        explicit fusion_manager(bool summarize_reads, const string &spill_directory = "") :
+            summarize_reads(summarize_reads || spill_directory != ""), spill_directory(spill_directory) {}
+        bool summarizes_reads() const{
+            return summarize_reads;
+        }
+        // Keeps only the fusions whose id keep accepts, for sharded runs. Set before adding reads.
+        void keep_only(std::function<bool(const string &)> keep){
+            keep_fusion = std::move(keep);
+        }
+        // Counts the breakpoints of forward and backward reads into their fusion's breakpoint_histograms
+        void collect_breakpoint_histograms(){
+            collect_breakpoints = true;
+        }
+        // Empty manager with these settings, for a chunk of reads merged back later
+        fusion_manager chunk_manager() const{
+            fusion_manager chunk(summarize_reads, spill_directory);
+            chunk.keep_fusion = keep_fusion;
+            chunk.collect_breakpoints = collect_breakpoints;
+            return chunk;
+        }
 
-        std::unordered_map<string, int> int_map;
-        string line;
-        while(std::getline(gtf_file, line)){
-            if(line[0]=='#'){ //Comment
-                continue;
+        // Calls f(first, last) over consecutive ranges of order, which is sorted_fusions(), covering all of it.
+        // The fusions get their spilled reads loaded back for the call, about bucket_reads reads at
+        // a time, and dropped again after it. Without spilled reads f sees all of order at once.
+        template<class F>
+        void for_each_read_range(const vector<const candidate_fusion *> &order, F f, size_t bucket_reads = size_t(1) << 20){
+            if(spill == NULL && bucket_files.empty()){
+                f(0, order.size());
+                return;
             }
-            vector<string> tabs = rsplit(line, "\t");
-            if(tabs[2] != "exon"){
-                continue;
+            if(bucket_files.empty()){
+                fill_buckets(order, bucket_reads);
             }
-
-            vector<string> fields = rsplit(tabs[8], ";");
-            string transcript_id = "-1";
-            int exon_number = -1;
-            for(auto iter = fields.begin(); iter != fields.end(); iter++){
-
-                if( iter->find("transcript_id") != string::npos){
-                    string _id = iter->substr(iter->find("d ")+3);
-                    _id.pop_back();
-                    if( _id.find(".") != string::npos){
-                        size_t dot_pos = _id.find(".");
-                        _id = _id.substr(0,dot_pos);
-                    }
-                    transcript_id = _id;
-
+            for(size_t b = 0; b < bucket_files.size(); ++b){
+                size_t first = bucket_starts[b];
+                size_t last = bucket_starts[b + 1];
+                vector<std::array<uint32_t, 4>> spilled;
+                for(size_t i = first; i < last; ++i){
+                    candidate_fusion &fusion = fusions[order[i] - fusions.data()];
+                    spilled.push_back(fusion.spilled_reads);
+                    fusion.spilled_reads = {};
+                }
+                spill_file &file = *bucket_files[b];
+                file.rewind();
+                while(spill_record.read(file)){
+                    candidate_fusion &fusion = fusions[order[spill_record.fusion] - fusions.data()];
+                    fusion.reads(spill_record.category).emplace_back(std::move(spill_record.read_id),
+                            fusion.summaries.size(), spill_record.summaries.size());
+                    fusion.summaries.insert(fusion.summaries.end(), spill_record.summaries.begin(), spill_record.summaries.end());
                 }
-                if( iter->find("exon_number") != string::npos){
-                    string _id = iter->substr(iter->find("r ")+3);
-                    _id.pop_back();
-                    if( _id.find(".") != string::npos){
-                        size_t dot_pos = _id.find(".");
-                        _id = _id.substr(0,dot_pos);
+                f(first, last);
+                for(size_t i = first; i < last; ++i){
+                    candidate_fusion &fusion = fusions[order[i] - fusions.data()];
+                    for(read_category category : {read_category::forward, read_category::backward,
+                            read_category::no_first, read_category::multi_first}){
+                        vector<fusion_read>().swap(fusion.reads(category));
                     }
-                    exon_number = stoi(_id);
-                        
+                    vector<read_gene_summary>().swap(fusion.summaries);
+                    fusion.spilled_reads = spilled[i - first];
                 }
             }
-            if( transcript_id == "-1"){
-                std::cerr << "Transcript doesn't have transcript_id\n";
-            }
-            if( exon_number > int_map[transcript_id]){
-                int_map[transcript_id] = exon_number;
-            }
         }
-        gtf_file.close();
-
-        return int_map;
-    }
 
-    template<class K, class V>
-    vector<std::pair<K, K>> get_key_pairs( const std::map<K,V> &map){
-        vector<std::pair<K,K>> pairs;
-        for(auto iter = std::begin(map); iter != std::end(map); ++iter){
-            for(auto inner = std::next(iter); inner !=std::end(map); ++inner){
-                pairs.emplace_back(iter->first, inner->first);
+        // Adds the fusions of other as if its reads had been added after the reads seen here
+        void merge(fusion_manager &&other){
+            // A manager whose reads were all dropped by keep_fusion still has their gene counts
+            if(fusions.empty() && gene_counts.empty()){
+                *this = std::move(other);
+                return;
             }
-        }
-        return pairs;
-    }
-
-    std::unordered_map<string, int> read_transcript_exon_counts(string gtf_path){
-        std::ifstream gtf_file(gtf_path);
-        if(!gtf_file.is_open()){
-            std::cerr << "[ERROR] Cannot open file:" << gtf_path << std::endl;
-            exit(-1);
-        } 
-
-        std::unordered_map<string, int> transcript_exon_counts;
-        string line;
-        while(std::getline(gtf_file, line)){
-            if(line[0]=='#'){ //Comment
-                continue;
+            if(gene_counts.size() < other.gene_counts.size()){
+                gene_counts.resize(other.gene_counts.size(), 0);
             }
-
-            vector<string> tabs = rsplit(line, "\t");
-            string ch(tabs[0]);
-            if(ch.find("chr")!=string::npos){
-                ch = ch.substr(3);
+            for(size_t gene = 0; gene < other.gene_counts.size(); ++gene){
+                gene_counts[gene] += other.gene_counts[gene];
             }
-            interval range( tabs[0], stoi(tabs[3]), stoi(tabs[4]), tabs[6]=="-");
-            if(tabs[2] != "exon"){
-                continue;
+            vector<uint32_t> fusion_map;
+            fusion_map.reserve(other.fusions.size());
+            for(candidate_fusion &fusion : other.fusions){
+                auto inserted = fusion_index.emplace(key_of(fusion.genes), fusions.size());
+                fusion_map.push_back(inserted.first->second);
+                if(inserted.second){
+                    fusions.push_back(std::move(fusion));
+                }
+                else{
+                    fusions[inserted.first->second].merge(std::move(fusion));
+                }
+            }
+            if(other.spill != NULL){
+                other.spill->rewind();
+                while(spill_record.read(*other.spill)){
+                    spill_record.fusion = fusion_map[spill_record.fusion];
+                    spill_read();
+                }
             }
-            vector<string> fields = rsplit(tabs[8], ";");
-            string transcript_id;
-            for(auto iter = fields.begin(); iter != fields.end(); iter++){
+            other = fusion_manager();
+        }
+        void add_read(const candidate_read &read, const gtf_index &annotation){
+            add_read(candidate_read{read}, annotation);
+        }
+        // Takes the read id, the blocks are appended to the fusion's block buffer.
+        // read keeps its block storage and can be reset and reused.
+        void add_read(candidate_read &&read, const gtf_index &annotation){
 
 
-                if( iter->find("transcript_id") != string::npos){
-                    string _id = iter->substr(iter->find("d ")+3);
-                    _id.pop_back();
-                    if( _id.find(".") != string::npos){
-                        size_t dot_pos = _id.find(".");
-                        _id = _id.substr(0,dot_pos);
-                    }
-                    transcript_id = _id;
-                    transcript_exon_counts[transcript_id]+=1;
-                    break;
-                } 
-/*  In case we have to handle duplicate exons.
-                if( iter->find("exon_number") != string::npos){
-                    string _id = iter->substr(iter->find("d ")+3);
-                    _id.pop_back();
-                    if( _id.find(".") != string::npos){
-                        size_t dot_pos = _id.find(".");
-                        _id = _id.substr(0,dot_pos);
-                    }
-                    exon_number = _id;
-*/
-                } 
+            columns.assign(read.blocks);
+            for(int gene_id : columns.genes){
+                if(annotation.find_gene(gene_id) == NULL){
+                    std::cerr << (gene_symbols.name(gene_id) + " is not in annotation!\n");
+                }
             }
+            // Genes in name order, as a gene_set would hold them
+            vector<int> &gene_ids = named_genes;
+            gene_ids.assign(columns.distinct_genes.begin(), columns.distinct_genes.end());
+            std::sort(gene_ids.begin(), gene_ids.end(), gene_order());
             
-        gtf_file.close();
-        return transcript_exon_counts;
-    }
-
-    std::unordered_map<string, gene> read_gene_annotation(string gtf_path){
-        std::ifstream gtf_file(gtf_path);
-        if(!gtf_file.is_open()){
-            std::cerr << "[ERROR] Cannot open file:" << gtf_path << std::endl;
-            exit(-1);
-        } 
 
-        std::unordered_map<string, gene> valid_set;
-        string line;
-        while(std::getline(gtf_file, line)){
-            if(line[0]=='#'){ //Comment
-                continue;
+            for( int gid : gene_ids){
+                if(static_cast<size_t>(gid) >= gene_counts.size()){
+                    gene_counts.resize(gid + 1, 0);
+                }
+                gene_counts[gid]+=1;
             }
-            gene g;
-            if(make_gene(line, g)){
-                valid_set.emplace( g.gene_id, g);
+            auto inserted = fusion_index.emplace(key_of(gene_ids), fusions.size());
+            if(!inserted.second && inserted.first->second == not_kept){
+                read.blocks.clear();
+                return;
             }
-        }
-        gtf_file.close();
-        return valid_set;
-    }
+            if(inserted.second){
+                string fusion_name = "";
+                for(int id : gene_ids){
+                    const gene *g = annotation.find_gene(id);
+                    fusion_name += (g ? g->gene_name : gene_symbols.name(id)) + "::";
+                }
 
-    void annotate_duplications_and_overlaps(fusion_manager &fm,
-            const std::unordered_map<string, gene> &gene_annot,
-            const string &dup_path){
+                fusion_name.pop_back();
+                fusion_name.pop_back();
 
-        IITree<locus, std::tuple<string, int, int, double> > duplications = read_duplication_annotation(dup_path);;
-        vector< size_t> overlaps;
-        for( auto &cand : fm.fusions){
-            std::map<string, interval> ivals = cand.second.fusion_gene_intervals();
-            auto key_pairs = get_key_pairs(ivals);
-                
+                string fusion_id = gene_symbols.name(*(std::begin(gene_ids)));
+                for(auto iter = std::next(std::begin(gene_ids)); iter != std::end(gene_ids); ++iter){
+                    fusion_id = dash_fold(fusion_id, gene_symbols.name(*iter));
+                }
+                if(keep_fusion && !keep_fusion(fusion_id)){
+                    inserted.first->second = not_kept;
+                    read.blocks.clear();
+                    return;
+                }
+                fusions.emplace_back();
+                candidate_fusion &fusion = fusions.back();
+                fusion.name = fusion_name;
+                fusion.id = fusion_id;
+                fusion.genes.assign(gene_ids.begin(), gene_ids.end());
+                fusion.summarized = summarize_reads;
+            }
+            auto &cand = fusions[inserted.first->second];
+            if(!columns.consistent_strands()){
+                //Invalid Strand configuration
+                //std::cerr << read.read_id << "\n";
+                //for(const string &id : gene_ids){
+                //    std::cerr << id<< "::";
+               // }
+                cand.invalid +=1;
+            }
+
+            // gene_transcripts and distinct_genes are both sorted by gene id
+            size_t transcript = 0;
+            for(size_t k = 0; k < columns.distinct_genes.size(); ++k){
+                int gid = columns.distinct_genes[k];
+                int max_exon_count = 1;
+                for(; transcript < columns.gene_transcripts.size() && columns.gene_transcripts[transcript].first == gid; ++transcript){
+                    int exon_count = annotation.exon_count(columns.gene_transcripts[transcript].second);
+
+                    if( max_exon_count < exon_count){
+                        max_exon_count = exon_count;
+                    }
+                }
+                double approximate_coverage = columns.gene_blocks[k];
+                cand.non_covered_sum_ratio[gid]+= 10.0 / (10 + max_exon_count - approximate_coverage);
+            }
+
+            read_category category;
+            if(read.first_exon_count > 1){
+                category = read_category::multi_first;
+            }
+            else if(read.first_exon_count == 0){
+                category = read_category::no_first;
+            }
+            else if(read.blocks[read.last_first_exon].second.gene_id == *(gene_ids.rbegin())){
+                category = read_category::forward;
+            }
+            else{
+                category = read_category::backward;
+            }
+            gene_map<genomic_position> bps;
+            if((summarize_reads || collect_breakpoints) &&
+                    (category == read_category::forward || category == read_category::backward)){
+                bps = read.ref().get_breakpoints(category == read_category::forward);
+            }
+            if(collect_breakpoints){
+                for(const auto &gene_bp : bps){
+                    cand.breakpoint_histograms[gene_bp.first].add(gene_bp.second);
+                }
+            }
+            if(spill_directory != ""){
+                spill_record.fusion = inserted.first->second;
+                spill_record.category = category;
+                spill_record.read_id = std::move(read.read_id);
+                spill_record.summaries.clear();
+                cand.summarize(read.ref(), category, bps, spill_record.summaries);
+                spill_read();
+                ++cand.spilled_reads[static_cast<size_t>(category)];
+                read.blocks.clear();
+                return;
+            }
+            if(summarize_reads){
+                size_t first_summary = cand.summaries.size();
+                cand.summarize(read.ref(), category, bps, cand.summaries);
+                cand.reads(category).emplace_back(std::move(read.read_id), first_summary, cand.summaries.size() - first_summary);
+                read.blocks.clear();
+                return;
+            }
+            cand.reads(category).emplace_back(std::move(read.read_id), cand.blocks.size(), read.blocks.size());
+            cand.blocks.insert(cand.blocks.end(), read.blocks.begin(), read.blocks.end());
+            read.blocks.clear();
+        }
+    };
+
+    template<class K, class V, class C>
+    vector<std::pair<K, K>> get_key_pairs( const std::map<K,V,C> &map){
+        vector<std::pair<K,K>> pairs;
+        for(auto iter = std::begin(map); iter != std::end(map); ++iter){
+            for(auto inner = std::next(iter); inner !=std::end(map); ++inner){
+                pairs.emplace_back(iter->first, inner->first);
+            }
+        }
+        return pairs;
+    }
+
+    class annotation_reference{
+        public:
+        gtf_index gtf;
+        duplication_tree duplications;
+    };
+
+// Binary annotation cache
+// Layout: cache_header, gene records, transcript records, duplication records, overlapping gene pairs
+// and a string pool. Strings are referenced by offset into the pool. Ids are interned when the cache is
+// read, so the loader reads the whole file and rebuilds the gene table, exon counts and duplication tree.
+    const char annotation_cache_magic[8] = {'G','N','A','N','C','A','C','H'};
+    const uint32_t annotation_cache_version = 2;
+
+    struct cache_string{
+        uint32_t offset;
+        uint32_t length;
+    };
+    struct cache_header{
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t gtf_size, gtf_mtime;
+        uint64_t dup_size, dup_mtime;
+        uint64_t gene_count, transcript_count, duplication_count, string_pool_size;
+        uint64_t gene_offset, transcript_offset, duplication_offset, string_pool_offset;
+        uint64_t gene_overlap_count, gene_overlap_offset;
+    };
+    struct cache_gene{
+        cache_string gene_id, gene_name, gene_type, chr;
+        int32_t start, end;
+        uint8_t reverse_strand, coding, padding[6];
+    };
+    struct cache_transcript{
+        cache_string transcript_id;
+        int32_t exon_count;
+    };
+    // Indices of both genes in the gene records, first gene in name order
+    struct cache_gene_overlap{
+        uint32_t first, second;
+    };
+    struct cache_duplication{
+        cache_string chr;
+        int32_t start, end;
+        cache_string mate_chr;
+        int32_t mate_start, mate_end;
+        double frac_match;
+    };
+
+    // Read only memory map of a whole file
+    class mapped_file{
+        void *mapped {MAP_FAILED};
+        size_t length {0};
+        bool opened {false};
+
+        public:
+        mapped_file(const string &path){
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0){
+                return;
+            }
+            struct stat st;
+            if(fstat(fd, &st) == 0){
+                length = st.st_size;
+                opened = length == 0;
+                if(length > 0){
+                    mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                    opened = mapped != MAP_FAILED;
+                }
+            }
+            close(fd);
+        }
+        ~mapped_file(){
+            if(mapped != MAP_FAILED){
+                munmap(mapped, length);
+            }
+        }
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        bool is_open() const{
+            return opened;
+        }
+        std::string_view view() const{
+            if(mapped == MAP_FAILED){
+                return std::string_view();
+            }
+            return std::string_view(static_cast<const char *>(mapped), length);
+        }
+    };
+
+    // Size and modification time, used to detect a cache built from other sources
+    std::pair<uint64_t, uint64_t> file_identity(const string &path){
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0){
+            return std::make_pair(0, 0);
+        }
+        return std::make_pair(static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mtime));
+    }
+
+    class cache_string_pool{
+        public:
+        string pool;
+        std::unordered_map<string, cache_string> offsets;
+        cache_string add(const string &str){
+            auto iter = offsets.find(str);
+            if(iter != offsets.end()){
+                return iter->second;
+            }
+            cache_string cs{static_cast<uint32_t>(pool.size()), static_cast<uint32_t>(str.size())};
+            pool += str;
+            offsets.emplace(str, cs);
+            return cs;
+        }
+    };
+
+    template<class T>
+    void write_records(std::ofstream &ost, const vector<T> &records){
+        ost.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(T));
+    }
+
+    bool write_annotation_cache(const string &cache_path, const string &gtf_path, const string &dup_path,
+            const annotation_reference &ref){
+
+        cache_string_pool strings;
+        vector<cache_gene> genes;
+        vector<cache_transcript> transcripts;
+        vector<cache_duplication> duplications;
+        vector<cache_gene_overlap> gene_overlaps;
+
+        // Genes are written in id order, which is name order for annotated genes
+        vector<uint32_t> gene_records(ref.gtf.genes.size());
+        for(const gene &g : ref.gtf.genes){
+            if(g.gene_id == -1){
+                continue;
+            }
+            gene_records[g.gene_id] = genes.size();
+            cache_gene cg;
+            std::memset(&cg, 0, sizeof(cg));
+            cg.gene_id = strings.add(gene_symbols.name(g.gene_id));
+            cg.gene_name = strings.add(g.gene_name);
+            cg.gene_type = strings.add(g.gene_type);
+            cg.chr = strings.add(chromosome_symbols.name(g.range.chr));
+            cg.start = g.range.start;
+            cg.end = g.range.end;
+            cg.reverse_strand = g.range.reverse_strand;
+            cg.coding = g.coding;
+            genes.push_back(cg);
+        }
+        for(size_t tid = 0; tid < ref.gtf.transcript_exon_counts.size(); ++tid){
+            int count = ref.gtf.transcript_exon_counts[tid];
+            if(count > 0){
+                transcripts.push_back(cache_transcript{strings.add(transcript_symbols.name(tid)), count});
+            }
+        }
+        for(uint64_t key : ref.gtf.overlapping_genes){
+            gene_overlaps.push_back(cache_gene_overlap{gene_records[key >> 32], gene_records[key & 0xffffffffu]});
+        }
+        for(size_t i = 0; i < ref.duplications.size(); ++i){
+            const auto &dup = ref.duplications.data(i);
+            cache_duplication cd;
+            std::memset(&cd, 0, sizeof(cd));
+            cd.chr = strings.add(chromosome_symbols.name(ref.duplications.start(i).chr));
+            cd.start = ref.duplications.start(i).position;
+            cd.end = ref.duplications.end(i).position;
+            cd.mate_chr = strings.add(chromosome_symbols.name(std::get<0>(dup)));
+            cd.mate_start = std::get<1>(dup);
+            cd.mate_end = std::get<2>(dup);
+            cd.frac_match = std::get<3>(dup);
+            duplications.push_back(cd);
+        }
+
+        cache_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, annotation_cache_magic, sizeof(header.magic));
+        header.version = annotation_cache_version;
+        std::tie(header.gtf_size, header.gtf_mtime) = file_identity(gtf_path);
+        std::tie(header.dup_size, header.dup_mtime) = file_identity(dup_path);
+        header.gene_count = genes.size();
+        header.transcript_count = transcripts.size();
+        header.duplication_count = duplications.size();
+        header.string_pool_size = strings.pool.size();
+        header.gene_offset = sizeof(cache_header);
+        header.transcript_offset = header.gene_offset + genes.size() * sizeof(cache_gene);
+        header.duplication_offset = header.transcript_offset + transcripts.size() * sizeof(cache_transcript);
+        header.gene_overlap_count = gene_overlaps.size();
+        header.gene_overlap_offset = header.duplication_offset + duplications.size() * sizeof(cache_duplication);
+        header.string_pool_offset = header.gene_overlap_offset + gene_overlaps.size() * sizeof(cache_gene_overlap);
+
+        // Write next to the destination and rename, so concurrent readers never see a partial file
+        string tmp_path = cache_path + ".tmp" + std::to_string(getpid());
+        std::ofstream ost(tmp_path, std::ios::binary);
+        if(!ost.is_open()){
+            std::cerr << "[WARNING] Cannot write annotation cache:" << cache_path << std::endl;
+            return false;
+        }
+        ost.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_records(ost, genes);
+        write_records(ost, transcripts);
+        write_records(ost, duplications);
+        write_records(ost, gene_overlaps);
+        ost.write(strings.pool.data(), strings.pool.size());
+        ost.close();
+        if(!ost || std::rename(tmp_path.c_str(), cache_path.c_str()) != 0){
+            std::cerr << "[WARNING] Cannot write annotation cache:" << cache_path << std::endl;
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Record i of the array of T at offset in a cache read into memory, whatever its alignment
+    template<class T>
+    T cache_record(const string &contents, uint64_t offset, size_t i){
+        T record;
+        std::memcpy(&record, contents.data() + offset + i * sizeof(T), sizeof(T));
+        return record;
+    }
+
+    bool read_annotation_cache(const string &cache_path, const string &gtf_path, const string &dup_path,
+            annotation_reference &ref){
+
+        std::ifstream file(cache_path, std::ios::binary | std::ios::ate);
+        if(!file.is_open()){
+            return false;
+        }
+        size_t file_size = file.tellg();
+        if(file_size < sizeof(cache_header)){
+            std::cerr << "[WARNING] Ignoring malformed annotation cache:" << cache_path << std::endl;
+            return false;
+        }
+        string contents(file_size, '\0');
+        file.seekg(0);
+        if(!file.read(&contents[0], file_size)){
+            std::cerr << "[WARNING] Cannot read annotation cache:" << cache_path << std::endl;
+            return false;
+        }
+        const cache_header header = cache_record<cache_header>(contents, 0, 0);
+
+        bool valid = std::memcmp(header.magic, annotation_cache_magic, sizeof(header.magic)) == 0 &&
+            header.version == annotation_cache_version &&
+            header.gene_offset + header.gene_count * sizeof(cache_gene) <= file_size &&
+            header.transcript_offset + header.transcript_count * sizeof(cache_transcript) <= file_size &&
+            header.duplication_offset + header.duplication_count * sizeof(cache_duplication) <= file_size &&
+            header.gene_overlap_offset + header.gene_overlap_count * sizeof(cache_gene_overlap) <= file_size &&
+            header.string_pool_offset + header.string_pool_size <= file_size;
+        if(!valid){
+            std::cerr << "[WARNING] Ignoring incompatible annotation cache:" << cache_path << std::endl;
+            return false;
+        }
+        if(std::make_pair(header.gtf_size, header.gtf_mtime) != file_identity(gtf_path) ||
+                std::make_pair(header.dup_size, header.dup_mtime) != file_identity(dup_path)){
+            std::cerr << "[WARNING] Annotation cache is older than its sources, ignoring:" << cache_path << std::endl;
+            return false;
+        }
+
+        const char *pool = contents.data() + header.string_pool_offset;
+        auto str = [pool](const cache_string &cs){
+            return string(pool + cs.offset, cs.length);
+        };
+
+        vector<std::pair<string, gene>> parsed_genes;
+        parsed_genes.reserve(header.gene_count);
+        for(size_t i = 0; i < header.gene_count; ++i){
+            const cache_gene cg = cache_record<cache_gene>(contents, header.gene_offset, i);
+            interval range(str(cg.chr), cg.start, cg.end, cg.reverse_strand);
+            parsed_genes.emplace_back(str(cg.gene_id), gene(range, -1, str(cg.gene_name), str(cg.gene_type), cg.coding));
+        }
+        ref.gtf.add_genes(parsed_genes);
+
+        vector<int> record_genes(header.gene_count);
+        for(size_t i = 0; i < header.gene_count; ++i){
+            record_genes[i] = gene_symbols.find(str(cache_record<cache_gene>(contents, header.gene_offset, i).gene_id));
+        }
+        for(size_t i = 0; i < header.gene_overlap_count; ++i){
+            const cache_gene_overlap overlap = cache_record<cache_gene_overlap>(contents, header.gene_overlap_offset, i);
+            if(overlap.first >= header.gene_count || overlap.second >= header.gene_count){
+                continue;
+            }
+            ref.gtf.overlapping_genes.insert(gtf_index::gene_pair_key(record_genes[overlap.first], record_genes[overlap.second]));
+        }
+
+        for(size_t i = 0; i < header.transcript_count; ++i){
+            const cache_transcript transcript = cache_record<cache_transcript>(contents, header.transcript_offset, i);
+            ref.gtf.set_exon_count(transcript_symbols.intern(str(transcript.transcript_id)), transcript.exon_count);
+        }
+
+        for(size_t i = 0; i < header.duplication_count; ++i){
+            const cache_duplication cd = cache_record<cache_duplication>(contents, header.duplication_offset, i);
+            int chr_id = chromosome_symbols.intern(str(cd.chr));
+            ref.duplications.add(genomic_position(chr_id, cd.start), genomic_position(chr_id, cd.end),
+                    std::make_tuple(chromosome_symbols.intern(str(cd.mate_chr)), cd.mate_start, cd.mate_end, cd.frac_match));
+        }
+        ref.duplications.index();
+        return true;
+    }
+
+    // Loads from cache_path when it holds a current cache, otherwise parses the text
+    // annotation and (if cache_path is given) writes the cache for the next run.
+    // Text sources may be gzip or bgzip compressed, thread_count threads inflate bgzip input.
+    // Without a cache, load_duplications false leaves the segdups to load_footprint_duplications.
+    void load_reference(annotation_reference &ref, const string &gtf_path, const string &dup_path,
+            const string &cache_path = "", size_t thread_count = 1, bool load_duplications = true,
+            stage_profiler *profiler = NULL){
+        stage_profiler disabled;
+        stage_profiler &profile = profiler != NULL ? *profiler : disabled;
+        if(cache_path != ""){
+            profile.begin("annotation_cache_load");
+            if(read_annotation_cache(cache_path, gtf_path, dup_path, ref)){
+                profile.count("genes", ref.gtf.genes.size());
+                profile.count("segdups", ref.duplications.size());
+                profile.end();
+                return;
+            }
+        }
+        profile.begin("gtf_load");
+        ref.gtf = gtf_index(gtf_path, false, thread_count);
+        profile.count("genes", ref.gtf.genes.size());
+        profile.count("transcripts", ref.gtf.transcript_exon_counts.size());
+        if(!load_duplications && cache_path == ""){
+            profile.end();
+            return;
+        }
+        profile.begin("segdup_load");
+        ref.duplications = read_duplication_annotation(dup_path, thread_count);
+        profile.count("segdups", ref.duplications.size());
+        if(cache_path != ""){
+            profile.begin("annotation_cache_write");
+            write_annotation_cache(cache_path, gtf_path, dup_path, ref);
+        }
+        profile.end();
+    }
+
+    // Options that genion's main does not forward to annotate_calls_direct.
+    class annotate_settings{
+        public:
+        string annotation_cache;
+        size_t threads {1};
+        // One summary row per fusion in the output and fusion_id, read_id rows in <output>.reads,
+        // instead of repeating the fusion columns for every supporting read
+        bool normalized_output {false};
+        // Fusion rows in the output as with normalized_output, and a typed columnar read table in <output>.cols
+        bool columnar_output {false};
+        // Load only the segdups overlapping the fusions' genes, ignored when an annotation cache is used
+        bool segdup_footprint {false};
+        // Stage timings and counts in <output>.profile.json
+        bool profile {false};
+        // Fold reads into per gene summaries as they are added instead of keeping their blocks
+        bool low_memory {false};
+        // Spill the read summaries to temporary files in this directory, keeping read counts in memory
+        string spill_directory;
+        // Write fusions below min_support to <output>.pruned without annotating or scoring them
+        bool prune_low_support {false};
+
+        static annotate_settings from_environment(){
+            annotate_settings settings;
+            const char *cache = std::getenv("GENION_ANNOTATION_CACHE");
+            if(cache != NULL){
+                settings.annotation_cache = cache;
+            }
+            const char *threads = std::getenv("GENION_THREADS");
+            if(threads != NULL && std::atoi(threads) > 0){
+                settings.threads = std::atoi(threads);
+            }
+            const char *normalized = std::getenv("GENION_NORMALIZED_OUTPUT");
+            settings.normalized_output = normalized != NULL && *normalized != '\0' && string(normalized) != "0";
+            const char *columnar = std::getenv("GENION_COLUMNAR_OUTPUT");
+            settings.columnar_output = columnar != NULL && *columnar != '\0' && string(columnar) != "0";
+            const char *footprint = std::getenv("GENION_SEGDUP_FOOTPRINT");
+            settings.segdup_footprint = footprint != NULL && *footprint != '\0' && string(footprint) != "0";
+            const char *profile = std::getenv("GENION_PROFILE");
+            settings.profile = profile != NULL && *profile != '\0' && string(profile) != "0";
+            const char *low_memory = std::getenv("GENION_LOW_MEMORY");
+            settings.low_memory = low_memory != NULL && *low_memory != '\0' && string(low_memory) != "0";
+            const char *spill_directory = std::getenv("GENION_SPILL_DIR");
+            if(spill_directory != NULL){
+                settings.spill_directory = spill_directory;
+            }
+            const char *prune = std::getenv("GENION_PRUNE_LOW_SUPPORT");
+            settings.prune_low_support = prune != NULL && *prune != '\0' && string(prune) != "0";
+            return settings;
+        }
+    };
+
+    // Output text built with operator<< like an ostream, without locales or stream state.
+    // Numbers are formatted with std::to_chars, doubles as ostream's default (%g, 6 digits).
+    class text_buffer{
+        public:
+        string text;
+
+        text_buffer &operator<<(std::string_view value){
+            text.append(value.data(), value.size());
+            return *this;
+        }
+        text_buffer &operator<<(const string &value){
+            text.append(value);
+            return *this;
+        }
+        text_buffer &operator<<(const char *value){
+            text.append(value);
+            return *this;
+        }
+        text_buffer &operator<<(char value){
+            text.push_back(value);
+            return *this;
+        }
+        text_buffer &operator<<(bool value){
+            text.push_back(value ? '1' : '0');
+            return *this;
+        }
+        template<class T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+        text_buffer &operator<<(T value){
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            text.append(digits, result.ptr - digits);
+            return *this;
+        }
+        text_buffer &operator<<(double value){
+            char digits[32];
+#if defined(__cpp_lib_to_chars)
+            auto result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::general, 6);
+            text.append(digits, result.ptr - digits);
+#else
+            int length = std::snprintf(digits, sizeof(digits), "%g", value);
+            text.append(digits, length);
+#endif
+            return *this;
+        }
+        text_buffer &operator<<(float value){
+            return *this << static_cast<double>(value);
+        }
+        size_t size() const{
+            return text.size();
+        }
+        void clear(){
+            text.clear();
+        }
+    };
+
+    // Collects text for sink and writes it in blocks of about capacity bytes, the rest when destroyed
+    class buffered_writer{
+        ostream &sink;
+        string buffer;
+        size_t capacity;
+
+        public:
+        buffered_writer(ostream &sink, size_t capacity = size_t(4) << 20) : sink(sink), capacity(capacity){
+            buffer.reserve(capacity);
+        }
+        ~buffered_writer(){
+            flush();
+        }
+        buffered_writer(const buffered_writer &) = delete;
+        buffered_writer &operator=(const buffered_writer &) = delete;
+
+        void write(std::string_view text){
+            if(buffer.size() + text.size() > capacity){
+                flush();
+            }
+            if(text.size() > capacity){
+                sink.write(text.data(), text.size());
+                return;
+            }
+            buffer.append(text.data(), text.size());
+        }
+        void flush(){
+            if(!buffer.empty()){
+                sink.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+            sink.flush();
+        }
+    };
+
+    // Text one record produces for each output stream of format_in_order
+    class formatted_record{
+        public:
+        vector<text_buffer> streams;
+
+        formatted_record(size_t stream_count) : streams(stream_count) {}
+        text_buffer &operator[](size_t k){
+            return streams[k];
+        }
+        void clear(){
+            for(auto &stream : streams){
+                stream.clear();
+            }
+        }
+    };
+
+    // formatted_record with a value that format fills and commit reads back, for output that is not text
+    template<class Slot>
+    class slotted_record : public formatted_record{
+        public:
+        Slot slot;
+
+        slotted_record(size_t stream_count) : formatted_record(stream_count) {}
+    };
+
+    // Formats records [0, n) in parallel batches with format(i, record) and writes
+    // record k-stream to sinks[k] in index order, so the output does not depend on thread_count.
+    // commit(i, record) then sees each record on this thread in index order, after its text is written.
+    // Sinks see large blocks through a buffered_writer each and are flushed on return.
+    template<class Record, class F, class C>
+    size_t format_records_in_order(size_t n, size_t thread_count, const vector<ostream *> &sinks, F format, C commit){
+        const size_t batch_size = std::max<size_t>(1, thread_count) * 256;
+        vector<Record> batch;
+        for(size_t i = 0; i < std::min(batch_size, n); ++i){
+            batch.emplace_back(sinks.size());
+        }
+        std::deque<buffered_writer> writers;
+        for(ostream *sink : sinks){
+            writers.emplace_back(*sink);
+        }
+        size_t bytes_written = 0;
+        for(size_t begin = 0; begin < n; begin += batch_size){
+            size_t count = std::min(n - begin, batch_size);
+            parallel_for(count, thread_count, [&] (size_t i) {
+                batch[i].clear();
+                format(begin + i, batch[i]);
+            });
+            for(size_t i = 0; i < count; ++i){
+                for(size_t k = 0; k < sinks.size(); ++k){
+                    writers[k].write(batch[i].streams[k].text);
+                    bytes_written += batch[i].streams[k].text.size();
+                }
+                commit(begin + i, batch[i]);
+            }
+        }
+        return bytes_written;
+    }
+
+    template<class F>
+    size_t format_in_order(size_t n, size_t thread_count, const vector<ostream *> &sinks, F format){
+        return format_records_in_order<formatted_record>(n, thread_count, sinks, format,
+                [] (size_t, const formatted_record &) {});
+    }
+
+    // Fusions only touch their own annotation here and both indices are read only, so fusions are
+    // annotated in parallel with one overlap buffer per worker. Returns the number of IITree queries.
+    size_t annotate_duplications_and_overlaps(fusion_manager &fm,
+            const gtf_index &annotation,
+            const duplication_tree &duplications,
+            size_t thread_count = 1){
+
+        vector<candidate_fusion *> fusions;
+        fusions.reserve(fm.fusions.size());
+        for( auto &cand : fm.fusions){
+            if(!cand.pruned){
+                fusions.push_back(&cand);
+            }
+        }
+        vector<vector< size_t>> worker_overlaps(worker_count(fusions.size(), thread_count));
+        vector<size_t> worker_queries(worker_overlaps.size(), 0);
+        parallel_for_workers(fusions.size(), thread_count, [&] (size_t worker, size_t index) {
+            candidate_fusion &fusion = *fusions[index];
+            vector< size_t> &overlaps = worker_overlaps[worker];
+            gene_map<interval> ivals = fusion.fusion_gene_intervals();
+            auto key_pairs = get_key_pairs(ivals);
+            worker_queries[worker] += key_pairs.size();
+                
             //Duplication annotation
             for(const auto &key_pair : key_pairs){
-                const string &f = key_pair.first;
-                const string &s = key_pair.second;
+                int f = key_pair.first;
+                int s = key_pair.second;
                 
                 const interval &i = (ivals.find(f))->second;
                 const auto loci = i.as_loci();
@@ -852,7 +2746,7 @@ namespace annotate{
                     interval l(std::get<0>(dup), std::get<1>(dup), std::get<2>(dup), 0);
                     interval &r =( ivals.find(s))->second; 
                     if(l.overlaps(r)){
-                        cand.second.duplications.emplace_back(i,l);
+                        fusion.duplications.emplace_back(i,l);
                     }
                 }
                 overlaps.clear(); 
@@ -861,14 +2755,41 @@ namespace annotate{
 
             //Gene overlap annotation
             for(const auto &key_pair : key_pairs){
-                const gene &f = gene_annot.find(key_pair.first)->second;
-                const gene &s = gene_annot.find(key_pair.second)->second;
-                if(f.range.overlaps(s.range)){
-                    cand.second.gene_overlaps.emplace_back(f,s); 
-                }             
+                if(annotation.genes_overlap(key_pair.first, key_pair.second)){
+                    fusion.gene_overlaps.emplace_back(*annotation.find_gene(key_pair.first), *annotation.find_gene(key_pair.second));
+                }
             }
             //X
+        });
+        return std::accumulate(worker_queries.begin(), worker_queries.end(), size_t(0));
+    }
+
+    // Chromosome ranges of every gene of every fusion, the only places segdups are looked up
+    locus_footprint fusion_footprint(const fusion_manager &fm, size_t thread_count = 1){
+        vector<vector<interval>> worker_intervals(worker_count(fm.fusions.size(), thread_count));
+        parallel_for_workers(fm.fusions.size(), thread_count, [&] (size_t worker, size_t index) {
+            if(fm.fusions[index].pruned){
+                return;
+            }
+            for(const auto &gene_interval : fm.fusions[index].fusion_gene_intervals()){
+                worker_intervals[worker].push_back(gene_interval.second);
+            }
+        });
+        locus_footprint footprint;
+        for(const auto &intervals : worker_intervals){
+            for(const interval &i : intervals){
+                footprint.add(i.chr, i.start, i.end);
+            }
         }
+        footprint.finish();
+        return footprint;
+    }
+
+    // Reads just the segdups that can annotate the fusions of fm, for runs that skipped them in load_reference
+    duplication_tree read_footprint_duplications(const string &dup_path, const fusion_manager &fm,
+            size_t thread_count = 1){
+        locus_footprint footprint = fusion_footprint(fm, thread_count);
+        return read_duplication_annotation(dup_path, thread_count, &footprint);
     }
 
 
@@ -884,144 +2805,1285 @@ namespace annotate{
         size_t total_chimer_count = 0;
 
         string line;
+        vector<std::string_view> fields;
         while(std::getline(feature_file, line)){
-            vector<string> fields =  rsplit(line, "\t");
-            if(!all && stoi(fields[2]) !=0){ // Split Alignment
+            split_fields(line, '\t', fields);
+            if(!all && parse_number<int>(fields[2]) !=0){ // Split Alignment
                 ++total_chimer_count;
                 continue;
             }
             ++total_normal_count;
             
-            string gene_id1 = fields[1].substr(0,15);
-            string gene_id2 = fields[1].substr(17);
+            string gene_id1(fields[1].substr(0,15));
+            string gene_id2(fields[1].substr(17));
             if(all){
                 count_table[gene_id1]+=1;
                 if(gene_id1 != gene_id2){
                     count_table[gene_id2]+=1;
                 }
             }
-            else{
-                if(gene_id1 == gene_id2){
-                    count_table[gene_id1]+=1;
+            else{
+                if(gene_id1 == gene_id2){
+                    count_table[gene_id1]+=1;
+                }
+            }
+
+        }
+        return std::make_pair(total_normal_count,total_chimer_count);
+    }
+
+
+    // Start of the first chain record at or after offset. A record is a "read_id\tblock_count" header
+    // followed by its block lines, and headers are the only lines with a single tab.
+    size_t next_chain_record(std::string_view chains, size_t offset){
+        if(offset == 0){
+            return 0;
+        }
+        size_t line_end = chains.find('\n', offset - 1);
+        while(line_end != std::string_view::npos && line_end + 1 < chains.size()){
+            size_t line = line_end + 1;
+            line_end = chains.find('\n', line);
+            std::string_view text = chains.substr(line, line_end == std::string_view::npos ? std::string_view::npos : line_end - line);
+            size_t tab = text.find('\t');
+            if(tab != std::string_view::npos && text.find('\t', tab + 1) == std::string_view::npos){
+                return line;
+            }
+        }
+        return chains.size();
+    }
+
+    // Adds the chain records of text, which starts at a record, to fm. Returns the number of reads.
+    size_t read_chain_records(std::string_view text, fusion_manager &fm, const gtf_index &annotation){
+        size_t pos = 0;
+        auto next_line = [&text, &pos] () {
+            size_t end = std::min(text.find('\n', pos), text.size());
+            std::string_view line = text.substr(pos, end - pos);
+            pos = std::min(end + 1, text.size());
+            return line;
+        };
+        candidate_read read;
+        vector<std::string_view> fields;
+        size_t read_count = 0;
+        while(pos < text.size()){
+            std::string_view header = next_line();
+            if(header.empty()){
+                continue;
+            }
+            split_fields(header, '\t', fields);
+            int block_count = parse_number<int>(fields[1]);
+            read.reset(string(fields[0]));
+            for(int i = 0; i < block_count; ++i){
+                read.add_block(next_line());
+            }
+            fm.add_read(std::move(read), annotation);
+            ++read_count;
+        }
+        return read_count;
+    }
+
+    // Chunks of chains.fixed.txt of about chunk_size bytes, cut at record boundaries, in file order.
+    // Plain files are mapped and chunks are views of the map; gzip and bgzip files are inflated a
+    // block at a time, so only the chunks not yet parsed are held in memory.
+    class chain_chunk_source{
+        mapped_file chain_file;
+        std::string_view chains; // mapped text
+        size_t chains_pos {0};
+        std::unique_ptr<text_reader> reader; // compressed input only
+        string pending; // inflated text not yet handed out
+        bool reader_end {false};
+        size_t chunk_size;
+
+        public:
+        class chunk{
+            public:
+            size_t sequence {0};
+            string text; // owned text of compressed input
+            size_t offset {0}, length {0}; // in the mapped text of plain input
+        };
+        size_t chunk_count {0};
+
+        chain_chunk_source(const string &path, size_t thread_count, size_t chunk_size) : chain_file(path), chunk_size(chunk_size){
+            if(!chain_file.is_open()){
+                throw annotate_error("Cannot open file:" + path);
+            }
+            chains = chain_file.view();
+            if(chains.size() >= 2 && chains[0] == '\x1f' && chains[1] == '\x8b'){
+                reader = std::make_unique<text_reader>(path, thread_count);
+                chains = std::string_view();
+            }
+        }
+        // Text of c. Chunks are moved through the queue, so views into a chunk's own (possibly short
+        // string optimized) text are only taken after its last move.
+        std::string_view text(const chunk &c) const{
+            return reader != NULL ? std::string_view(c.text) : chains.substr(c.offset, c.length);
+        }
+        // Next chunk in c, false after the last one
+        bool next(chunk &c){
+            c.sequence = chunk_count;
+            c.text.clear();
+            if(reader == NULL){
+                if(chains_pos >= chains.size()){
+                    return false;
+                }
+                size_t end = next_chain_record(chains, std::min(chains.size(), chains_pos + chunk_size));
+                c.offset = chains_pos;
+                c.length = end - chains_pos;
+                chains_pos = end;
+                ++chunk_count;
+                return true;
+            }
+            // Cut at the first record at or after chunk_size whose header line is complete
+            size_t end = string::npos;
+            while(end == string::npos){
+                size_t complete = pending.rfind('\n');
+                if(pending.size() > chunk_size && complete != string::npos && complete >= chunk_size){
+                    std::string_view whole(pending.data(), complete + 1);
+                    size_t start = next_chain_record(whole, chunk_size);
+                    if(start < whole.size()){
+                        end = start;
+                        break;
+                    }
+                }
+                if(reader_end || !reader->read_block(pending)){
+                    reader_end = true;
+                    end = pending.size();
+                }
+            }
+            if(end == 0){
+                return false;
+            }
+            c.text.assign(pending, 0, end);
+            pending.erase(0, end);
+            ++chunk_count;
+            return true;
+        }
+    };
+
+    // Parses chains.fixed.txt as a pipeline: this thread cuts chunks of about chunk_size bytes at record
+    // boundaries while thread_count workers parse them, each chunk into its own fusion_manager, and
+    // merge the parsed chunks into fm in file order as they become ready, so the result does not
+    // depend on thread_count. At most 4 * thread_count chunks are read and not yet merged at a time,
+    // which bounds the memory of compressed input and the number of partial managers and their
+    // spill files. An exception of a worker or of reading stops the pipeline and is rethrown once every
+    // worker has finished. Returns the number of reads.
+    size_t read_chains(const string &path, const gtf_index &annotation, fusion_manager &fm,
+            size_t thread_count = 1, size_t chunk_size = size_t(16) << 20){
+        chain_chunk_source source(path, thread_count, chunk_size);
+        const fusion_manager settings = fm.chunk_manager(); // fm itself is merged into while chunks start
+        const size_t worker_total = std::max<size_t>(1, thread_count);
+        const size_t in_flight_limit = worker_total * 4;
+
+        std::mutex mutex;
+        std::condition_variable chunk_ready;   // queued chunk or end of input, for workers
+        std::condition_variable chunk_merged;  // room for another chunk, for this thread
+        std::deque<chain_chunk_source::chunk> queue;
+        std::map<size_t, fusion_manager> parsed; // by sequence, waiting for the earlier chunks
+        size_t in_flight = 0; // queued, parsing or parsed and not merged
+        size_t next_merge = 0;
+        bool merging = false;
+        bool input_end = false;
+        std::exception_ptr error;
+        std::atomic<size_t> read_count{0};
+
+        auto fail = [&] () {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(error == NULL){
+                error = std::current_exception();
+            }
+            chunk_ready.notify_all();
+            chunk_merged.notify_all();
+        };
+        auto parse_chunks = [&] () {
+            fusion_manager chunk_fm;
+            for(;;){
+                chain_chunk_source::chunk c;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    chunk_ready.wait(lock, [&] { return !queue.empty() || input_end || error != NULL; });
+                    if(queue.empty() || error != NULL){
+                        return;
+                    }
+                    c = std::move(queue.front());
+                    queue.pop_front();
+                }
+                chunk_fm = settings.chunk_manager();
+                read_count += read_chain_records(source.text(c), chunk_fm, annotation);
+                c.text = string();
+
+                std::unique_lock<std::mutex> lock(mutex);
+                parsed.emplace(c.sequence, std::move(chunk_fm));
+                if(merging){
+                    continue; // the merging worker picks it up
+                }
+                merging = true;
+                for(auto iter = parsed.find(next_merge); iter != parsed.end(); iter = parsed.find(next_merge)){
+                    fusion_manager ready = std::move(iter->second);
+                    parsed.erase(iter);
+                    lock.unlock();
+                    fm.merge(std::move(ready));
+                    lock.lock();
+                    ++next_merge;
+                    --in_flight;
+                    chunk_merged.notify_one();
+                }
+                merging = false;
+            }
+        };
+        auto worker = [&] () {
+            try{
+                parse_chunks();
+            }
+            catch(...){
+                fail();
+            }
+        };
+        vector<std::thread> workers;
+        for(size_t w = 0; w < worker_total; ++w){
+            workers.emplace_back(worker);
+        }
+        try{
+            chain_chunk_source::chunk c;
+            while(source.next(c)){
+                std::unique_lock<std::mutex> lock(mutex);
+                chunk_merged.wait(lock, [&] { return in_flight < in_flight_limit || error != NULL; });
+                if(error != NULL){
+                    break;
+                }
+                queue.push_back(std::move(c));
+                ++in_flight;
+                chunk_ready.notify_one();
+            }
+        }
+        catch(...){
+            fail();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            input_end = true;
+        }
+        chunk_ready.notify_all();
+        for(auto &w : workers){
+            w.join();
+        }
+        if(error != NULL){
+            std::rethrow_exception(error);
+        }
+        assert(parsed.empty() && next_merge == source.chunk_count);
+        return read_count;
+    }
+
+    std::unordered_map<string, SEQDIR>  read_read_directions(const string &path){
+        
+        std::unordered_map<string, SEQDIR> directions; 
+        std::ifstream dir_file(path);
+        string line;
+        vector<std::string_view> fields;
+
+        while(std::getline(dir_file, line)){
+            split_fields(line, '\t', fields);
+            string read_id(fields[0]);
+            if(fields[1] =="NONE"){
+                directions[read_id] = SEQDIR::unknown;
+                continue;
+            }
+            if(fields[1] == "A" && parse_number<int>(fields[2]) > 50){
+                directions[read_id] = SEQDIR::reverse;
+            }
+            else if (fields[1] == "T" && parse_number<int>(fields[2]) < 50){
+                directions[read_id] = SEQDIR::forward;
+            }
+            else{
+                directions[read_id] = SEQDIR::unknown;
+            }
+        }
+        return directions;
+    }
+
+    bool is_cluster_rt( const candidate_fusion &cf, double fin,
+            double forw_rt_ex, double back_rt_ex,
+            int max_rt_distance = 50000, double max_fin = 0.1){
+        
+        const block_span blocks = cf.representative_blocks();
+        //vector<std::pair<interval, exon> > blocks;
+    
+        if( blocks.size() < 2){
+            return false;
+        }
+        size_t i = 0;
+        for( i=1; i < blocks.size(); ++i){
+            if( blocks[i].second.gene_id != blocks[i-1].second.gene_id){
+                break;
+            }
+        }
+
+        auto b1 = blocks[i-1];
+        auto b2 = blocks[i];
+
+        if( b1.second.range.chr != b2.second.range.chr){
+            return false;
+        }
+        std::array<int, 4> positions {{ b1.second.range.start, b1.second.range.end,  b2.second.range.start, b2.second.range.end}};
+        std::sort(positions.begin(),positions.end());
+        int distance = positions[2] - positions[1];
+        if( distance > max_rt_distance){
+            return false;
+        }
+        if( forw_rt_ex < 0.8 || back_rt_ex < 0.8){
+            return false;
+        }
+        if( fin > max_fin){
+            return false;
+        }
+
+        return true;
+    }
+   
+    // Normal (non chimeric) read counts from the feature table, indexed by gene symbol
+    vector<size_t> index_gene_counts(const std::unordered_map<string, size_t> &gene_counts){
+        vector<size_t> counts(gene_symbols.size(), 0);
+        for(const auto &gene_count : gene_counts){
+            int gid = gene_symbols.find(gene_count.first);
+            if(gid != -1){
+                counts[gid] = gene_count.second;
+            }
+        }
+        return counts;
+    }
+
+    // Arguments of the hypergeometric test of one fusion, ordered so equal tests can share one evaluation
+    struct hypergeometric_query{
+        int x;
+        int n;
+        int m;
+        int N;
+
+        bool operator<(const hypergeometric_query &other) const{
+            return std::tie(x, n, m, N) < std::tie(other.x, other.n, other.m, other.N);
+        }
+        bool operator==(const hypergeometric_query &other) const{
+            return x == other.x && n == other.n && m == other.m && N == other.N;
+        }
+    };
+
+    hypergeometric_query candidate_test_query(const candidate_fusion &fusion,
+            double chimera_rate,
+            const vector<size_t> &gene_counts
+            ){
+
+            
+        vector<size_t> normal_counts;
+        for(int gene : fusion.genes){
+            normal_counts.push_back(gene_counts[gene]);
+        }
+
+        size_t mult_count = std::accumulate(normal_counts.begin(), normal_counts.end(), 1L, std::multiplies<size_t>());
+        double average_normal_count = std::pow(static_cast<double>(mult_count), 1.0/normal_counts.size());
+
+        int x = fusion.total_count();
+        int n = x + average_normal_count;
+        int m = x + chimera_rate * average_normal_count;
+        int N = 2 * n; 
+        return {x, n, m, N};
+    }
+
+    // Significance level of the multiple test correction of the fusion p-values
+    const double fusion_test_alpha = 0.05;
+
+    // Upper tails P(X >= x) of hypergeometric tests from a table of log factorials up to max_N, so a test
+    // costs one term per value of the shorter tail instead of factorials of its N
+    class hypergeometric_table{
+        vector<double> log_factorials;
+
+        double log_choose(int n, int k) const{
+            return log_factorials[n] - log_factorials[k] - log_factorials[n - k];
+        }
+
+        public:
+        static constexpr int max_table_N = 1 << 22;
+
+        explicit hypergeometric_table(int max_N) : log_factorials(std::min(std::max(max_N, 0), max_table_N) + 1, 0.0){
+            for(size_t k = 2; k < log_factorials.size(); ++k){
+                log_factorials[k] = std::lgamma(k + 1.0); // a running sum of logs drifts for large k
+            }
+        }
+        bool covers(const hypergeometric_query &q) const{
+            return q.N >= 0 && static_cast<size_t>(q.N) < log_factorials.size() && q.n >= 0 && q.n <= q.N
+                && q.m >= 0 && q.m <= q.N;
+        }
+        // P(X >= x) for X the successes in n draws without replacement from N items, m of them successes.
+        // Sums from the tail's end next to the mode outwards, over terms that only get smaller.
+        double upper_tail(const hypergeometric_query &q) const{
+            int low = std::max(0, q.n + q.m - q.N);
+            int high = std::min(q.n, q.m);
+            if(q.x <= low){
+                return 1.0;
+            }
+            if(q.x > high){
+                return 0.0;
+            }
+            auto pmf = [&] (int i) {
+                return std::exp(log_choose(q.m, i) + log_choose(q.N - q.m, q.n - i) - log_choose(q.N, q.n));
+            };
+            const double rest = q.N - q.m - q.n;
+            int mode = static_cast<int>((q.n + 1.0) * (q.m + 1.0) / (q.N + 2.0));
+            double sum = 0;
+            if(q.x > mode){
+                double term = pmf(q.x);
+                for(int i = q.x; i <= high && term > sum * 1e-18; ++i){
+                    sum += term;
+                    term *= static_cast<double>(q.m - i) * (q.n - i) / ((i + 1.0) * (rest + i + 1.0));
+                }
+                return std::min(1.0, sum);
+            }
+            double term = pmf(q.x - 1);
+            for(int i = q.x - 1; i >= low && term > sum * 1e-18; --i){
+                sum += term;
+                term *= i * (rest + i) / ((q.m - i + 1.0) * (q.n - i + 1.0));
+            }
+            return std::max(0.0, 1.0 - sum);
+        }
+    };
+
+    // p-values of all fusions, tested as one batch before multiple_test
+    vector<double> statistically_test_candidates(const vector<const candidate_fusion *> &fusions,
+            double chimera_rate,
+            const vector<size_t> &gene_counts,
+            size_t thread_count = 1){
+        vector<hypergeometric_query> queries(fusions.size());
+        parallel_for(fusions.size(), thread_count, [&] (size_t i) {
+            queries[i] = candidate_test_query(*fusions[i], chimera_rate, gene_counts);
+        });
+        vector<hypergeometric_query> distinct = queries;
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+        int max_N = 0;
+        for(const hypergeometric_query &q : distinct){
+            max_N = std::max(max_N, q.N);
+        }
+        hypergeometric_table table(max_N);
+        // p-values at or below alpha can decide PASS or FAIL and are taken from hyper_geom_cdf, as is a
+        // sample of the others to check the table against it
+        const size_t check_stride = std::max<size_t>(1, distinct.size() / 16);
+        std::atomic<bool> table_differs{false};
+        vector<double> distinct_pvalues(distinct.size());
+        parallel_for(distinct.size(), thread_count, [&] (size_t i) {
+            const hypergeometric_query &q = distinct[i];
+            bool tabulated = table.covers(q);
+            double pvalue = tabulated ? table.upper_tail(q) : 1.0;
+            if(!tabulated || pvalue <= fusion_test_alpha * (1 + 1e-6) || i % check_stride == 0){
+                double exact = hyper_geom_cdf(q.x, q.n, q.m, q.N);
+                if(tabulated && pvalue > fusion_test_alpha && std::abs(exact - pvalue) > 1e-6 * exact){
+                    table_differs = true;
+                }
+                pvalue = exact;
+            }
+            distinct_pvalues[i] = pvalue;
+        });
+        if(table_differs){
+            std::cerr << "[WARNING] Hypergeometric table disagrees with hyper_geom_cdf, using hyper_geom_cdf for every test" << std::endl;
+            parallel_for(distinct.size(), thread_count, [&] (size_t i) {
+                const hypergeometric_query &q = distinct[i];
+                distinct_pvalues[i] = hyper_geom_cdf(q.x, q.n, q.m, q.N);
+            });
+        }
+
+        vector<double> pvalues(fusions.size());
+        parallel_for(fusions.size(), thread_count, [&] (size_t i) {
+            pvalues[i] = distinct_pvalues[std::lower_bound(distinct.begin(), distinct.end(), queries[i]) - distinct.begin()];
+        });
+        return pvalues;
+    }
+
+    // Sharded runs split the fusions of one sample between processes (or nodes) in two passes.
+    // The test pass (--shard K/N) tests the fusions whose id hashes to K and writes their p-values,
+    // merge_shard_pvalues corrects the p-values of all shards at once, and the output pass
+    // (--shard K/N --shard-correction) scores and writes the K-th of N consecutive ranges of fusions in id order.
+    // Every shard parses all reads, so gene counts are those of a single run, and the fusion total comes
+    // with the correction. Concatenating the output passes' calls and breakpoints in shard order gives
+    // the single run's output.
+    class shard_correction{
+        public:
+        vector<string> ids; // sorted
+        vector<double> pvalues;
+        vector<double> corr_pvalues;
+        vector<bool> null_rejected;
+
+        // Index of id in ids, ids.size() if it is not there
+        size_t find(const string &id) const{
+            auto iter = std::lower_bound(ids.begin(), ids.end(), id);
+            return iter != ids.end() && *iter == id ? iter - ids.begin() : ids.size();
+        }
+        // [first, last) of ids owned by shard index of count in the output pass
+        std::pair<size_t, size_t> range(size_t index, size_t count) const{
+            return std::make_pair(ids.size() * index / count, ids.size() * (index + 1) / count);
+        }
+        bool write(const string &path) const{
+            std::ofstream file(path);
+            if(!file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << path << std::endl;
+                return false;
+            }
+            file << std::setprecision(17);
+            for(size_t i = 0; i < ids.size(); ++i){
+                file << ids[i] << "\t" << pvalues[i] << "\t" << corr_pvalues[i] << "\t" << null_rejected[i] << "\n";
+            }
+            return static_cast<bool>(file);
+        }
+        bool read(const string &path){
+            std::ifstream file(path);
+            if(!file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << path << std::endl;
+                return false;
+            }
+            vector<std::string_view> fields;
+            string line;
+            while(std::getline(file, line)){
+                split_fields(line, '\t', fields);
+                if(fields.size() < 4){
+                    std::cerr << "[ERROR] Malformed shard correction line: " << line << std::endl;
+                    return false;
+                }
+                ids.emplace_back(fields[0]);
+                pvalues.push_back(std::strtod(string(fields[1]).c_str(), NULL));
+                corr_pvalues.push_back(std::strtod(string(fields[2]).c_str(), NULL));
+                null_rejected.push_back(fields[3] == "1");
+            }
+            return true;
+        }
+    };
+
+    // FNV-1a of a fusion id, the same on every node
+    uint64_t fusion_id_hash(const string &id){
+        uint64_t hash = 14695981039346656037ull;
+        for(char c : id){
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Shard index of count. Test pass without a correction, output pass with one.
+    class fusion_shard{
+        public:
+        size_t index;
+        size_t count;
+        const shard_correction *correction;
+
+        bool owns(const string &fusion_id) const{
+            if(correction == NULL){
+                return fusion_id_hash(fusion_id) % count == index;
+            }
+            auto range = correction->range(index, count);
+            return range.first < range.second && correction->ids[range.first] <= fusion_id
+                && fusion_id <= correction->ids[range.second - 1];
+        }
+        // Parses "K/N" with K < N
+        static bool parse(const string &text, fusion_shard &shard){
+            size_t slash = text.find('/');
+            if(slash == string::npos){
+                return false;
+            }
+            char *end;
+            shard.index = std::strtoul(text.c_str(), &end, 10);
+            if(end != text.c_str() + slash){
+                return false;
+            }
+            shard.count = std::strtoul(text.c_str() + slash + 1, &end, 10);
+            shard.correction = NULL;
+            return *end == '\0' && shard.count > 0 && shard.index < shard.count;
+        }
+    };
+
+    // Corrects the p-values of every test pass shard together, as a single run would
+    bool merge_shard_pvalues(const vector<string> &shard_paths, const string &correction_path){
+        vector<std::pair<string, double>> tested;
+        vector<std::string_view> fields;
+        string line;
+        for(const string &path : shard_paths){
+            std::ifstream file(path);
+            if(!file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << path << std::endl;
+                return false;
+            }
+            while(std::getline(file, line)){
+                split_fields(line, '\t', fields);
+                if(fields.size() < 2){
+                    std::cerr << "[ERROR] Malformed shard p-value line: " << line << std::endl;
+                    return false;
+                }
+                tested.emplace_back(string(fields[0]), std::strtod(string(fields[1]).c_str(), NULL));
+            }
+        }
+        std::sort(tested.begin(), tested.end());
+        shard_correction correction;
+        for(const auto &id_pvalue : tested){
+            if(!correction.ids.empty() && correction.ids.back() == id_pvalue.first){
+                std::cerr << "[ERROR] Fusion " << id_pvalue.first << " was tested by more than one shard" << std::endl;
+                return false;
+            }
+            correction.ids.push_back(id_pvalue.first);
+            correction.pvalues.push_back(id_pvalue.second);
+        }
+        auto hypothesis = multiple_test(correction.pvalues, fusion_test_alpha, pvalue_corrector::BENJAMINI_YEKUTIELI);
+        correction.corr_pvalues = hypothesis.corr_pvals;
+        correction.null_rejected.assign(hypothesis.null_rejected.begin(), hypothesis.null_rejected.end());
+        return correction.write(correction_path);
+    }
+
+    // Inputs of score_fusion that are the same for every fusion
+    struct scoring_context{
+        fusion_manager &fm; // not const so that classify_fusions can load spilled reads back
+        const gtf_index &annotation;
+        const vector<size_t> &normal_counts;
+        size_t min_support;
+        bool only_coding;
+        long maxrtdistance;
+        double maxrtfin;
+        size_t total_fusions {0}; // of the whole run when fm holds one shard, 0 for fm's fusions
+
+        size_t fusion_count() const{
+            return total_fusions != 0 ? total_fusions : fm.fusions.size();
+        }
+    };
+
+    // Scores and PASS/FAIL code of one fusion
+    struct fusion_score{
+        bool null_rejected;
+        double pvalue;
+        double corr_pvalue;
+        int total_count;
+        int total_count_putative_full_length;
+        double gene_count_sum {0};
+        double total_idf {0};
+        double tfidf_score;
+        double tfidf_score_full_len;
+        double fin_score;
+        double fg_count;
+        double lg_count;
+        double forward_rt_ex;
+        double backward_rt_ex;
+        string pass_fail_code;
+    };
+
+    void score_fusion(const candidate_fusion &fusion, const scoring_context &context, fusion_score &score, text_buffer &errors){
+        const vector<int> &genes = fusion.genes;
+        int total_count = fusion.total_count();
+        score.total_count = total_count;
+        score.total_count_putative_full_length = fusion.read_count(read_category::forward)
+            + fusion.read_count(read_category::backward);
+
+        bool coding_flag = false;
+        if( context.only_coding){
+            for( int g : genes){
+                const gene *gptr = context.annotation.find_gene(g);
+                if(gptr == NULL){
+                    errors << "Gene " << gene_symbols.name(g) << " is not in annotation!\n";
+                    continue;
+                }
+                if(gptr->coding == false){
+                    coding_flag = true;
+                    break;
+                }
+            }
+        }
+        for(int gene : genes){
+            size_t normal_count = context.normal_counts[gene];
+            int other_count = context.fm.gene_count(gene) - total_count;
+            score.gene_count_sum += normal_count;
+            score.total_idf+= other_count;
+        }
+        
+        score.tfidf_score = total_count * std::log(context.fusion_count()/(1+score.total_idf/2));
+        score.tfidf_score_full_len = score.total_count_putative_full_length * std::log(context.fusion_count()/(1+score.total_idf/2));
+        
+        int tcpflnz;
+        if(total_count == 0){
+            tcpflnz = 1;
+        }
+        else{
+            tcpflnz = total_count;
+        }
+
+        score.fin_score = genes.size() * total_count / (score.gene_count_sum+1);
+
+        score.fg_count = fusion.non_covered_sum_ratio.at(genes[0]);
+        score.lg_count = fusion.non_covered_sum_ratio.at(genes[1]);
+        score.forward_rt_ex  =  1.0 * score.fg_count / tcpflnz;
+        score.backward_rt_ex = 1.0 * score.lg_count / tcpflnz;
+        double bad_strand_ratio = static_cast<double>(fusion.invalid)/fusion.total_count();
+        string &pass_fail_code = score.pass_fail_code;
+        if(coding_flag){
+            pass_fail_code += ":noncoding";
+        }
+
+        if(fusion.gene_overlaps.size() > 0){
+            pass_fail_code += ":overlaps";
+        }
+        if(fusion.duplications.size() > 0){
+            pass_fail_code += ":segdup";
+        }
+        if(bad_strand_ratio > 0.25){
+            pass_fail_code += ":badstrand";
+        }
+        if( fusion.support_count() < context.min_support){
+            pass_fail_code += ":lowsup";
+        }
+        if( pass_fail_code != ""){
+            pass_fail_code = "FAIL" + pass_fail_code;
+        }
+        else{
+            if( is_cluster_rt( fusion, score.fin_score, score.forward_rt_ex, score.backward_rt_ex, 
+                        context.maxrtdistance, context.maxrtfin)){
+                pass_fail_code = "PASS:RT";
+            }
+            else if( score.null_rejected){
+                pass_fail_code = "PASS:GF";
+            }
+            else{
+                pass_fail_code = "FAIL:RP";
+            }
+        }
+    }
+
+    // Per gene normal read counts of a fusion as "n1;n2;", formatted only where it is written
+    struct normal_count_list{
+        const candidate_fusion &fusion;
+        const scoring_context &context;
+
+        template<class O>
+        friend O &operator<<(O &os, const normal_count_list &list){
+            for(int gene : list.fusion.genes){
+                os << list.context.normal_counts[gene] << ";";
+            }
+            return os;
+        }
+    };
+
+    // Per gene counts of reads in other fusions as "n1;n2;" (the idf string), formatted only where it is written
+    struct other_fusion_count_list{
+        const candidate_fusion &fusion;
+        const scoring_context &context;
+
+        template<class O>
+        friend O &operator<<(O &os, const other_fusion_count_list &list){
+            int total_count = list.fusion.total_count();
+            for(int gene : list.fusion.genes){
+                os << list.context.fm.gene_count(gene) - total_count << ";";
+            }
+            return os;
+        }
+    };
+
+    //#FusionID(Ensembl) Forward-Support Backward-Support Multi-First-Exon No-First-Exon Genes-Overlap Segmental-Duplication-Count FusionName(Symbol) FiN-Score Pass-Fail-Status total-normal-count fusion-count normal-counts proper-normal-count proper-FiN-Score total-other-fusion-count other-fusion-counts ffigf-score proper-ffigf-score A B Anorm Bnorm 
+    void print_fusion_columns(text_buffer &out, const candidate_fusion &fusion, const fusion_score &score,
+            const scoring_context &context){
+        out << fusion.id << "\t" << fusion.read_count(read_category::forward) << "\t"
+            << fusion.read_count(read_category::backward)  << "\t"
+            << fusion.read_count(read_category::multi_first) << "\t" << fusion.read_count(read_category::no_first)
+            << "\t" <<  fusion.gene_overlaps.size() 
+            << "\t" <<  fusion.duplications.size()
+            << "\t" << fusion.name << "\t" << score.fin_score
+            << "\t" <<  score.pass_fail_code
+            << "\t" << score.gene_count_sum << "\t" << score.total_count <<  "\t"  << normal_count_list{fusion, context} << "\t"
+            << score.total_count_putative_full_length << "\t" << fusion.genes.size() * score.total_count_putative_full_length / ( score.gene_count_sum + 1)
+            << "\t" <<  score.total_idf << "\t" << other_fusion_count_list{fusion, context} << "\t" << score.tfidf_score << "\t" << score.tfidf_score_full_len
+            << "\t" << score.fg_count  << "\t" << score.lg_count << "\t"
+            << score.forward_rt_ex << "\t" << score.backward_rt_ex << "\t"
+            << score.pvalue << "\t" << score.corr_pvalue << "\t" << (score.null_rejected?"pPASS":"pFAIL") 
+            << "\t" << static_cast<double>(fusion.invalid)/fusion.total_count();
+    }
+
+    // Output policies of classify_fusions. sinks() lists the output streams, the first is std::cerr
+    // for warnings. emit() writes one scored fusion to the record of those streams, on any thread.
+    // commit() sees the scored fusions again on one thread in fusion id order, for output that is not text.
+
+    // All columns, one line per supporting read (the read id is the last column)
+    class per_read_output{
+        std::ofstream outfile;
+        std::ofstream outfile_fail;
+        std::ofstream logfile;
+
+        public:
+        per_read_output(const string &output_path, const string &log_path) :
+            outfile(output_path), outfile_fail(output_path + ".fail"), logfile(log_path) {}
+
+        vector<ostream *> sinks(){
+            return {&std::cerr, &outfile};
+        }
+        void emit(const candidate_fusion &fusion, const fusion_score &score, const scoring_context &context,
+                formatted_record &record) const{
+            text_buffer summary;
+            print_fusion_columns(summary, fusion, score, context);
+            for(const auto& cr : fusion.reads({read_category::forward, read_category::backward,
+                        read_category::multi_first, read_category::no_first})) {
+                record[1] << summary.text << "\t" << cr.read_id << "\n";
+            }
+        }
+        void commit(const candidate_fusion &, const fusion_score &){}
+    };
+
+    // All columns once per fusion, and fusion_id, read_id lines in <output>.reads
+    class normalized_output{
+        std::ofstream outfile;
+        std::ofstream outfile_fail;
+        std::ofstream logfile;
+        std::ofstream read_table;
+
+        public:
+        normalized_output(const string &output_path, const string &log_path) :
+            outfile(output_path), outfile_fail(output_path + ".fail"), logfile(log_path), read_table(output_path + ".reads") {}
+
+        vector<ostream *> sinks(){
+            return {&std::cerr, &outfile, &read_table};
+        }
+        void emit(const candidate_fusion &fusion, const fusion_score &score, const scoring_context &context,
+                formatted_record &record) const{
+            print_fusion_columns(record[1], fusion, score, context);
+            record[1] << "\n";
+            for(const auto& cr : fusion.reads({read_category::forward, read_category::backward,
+                        read_category::multi_first, read_category::no_first})) {
+                record[2] << fusion.id << "\t" << cr.read_id << "\n";
+            }
+        }
+        void commit(const candidate_fusion &, const fusion_score &){}
+    };
+
+    // Short PASS lines with median breakpoint ranges and a read log, FAIL lines in <output>.fail
+    class pass_fail_output{
+        std::ofstream outfile;
+        std::ofstream outfile_fail;
+        std::ofstream logfile;
+
+        public:
+        pass_fail_output(const string &output_path, const string &log_path) :
+            outfile(output_path), outfile_fail(output_path + ".fail"), logfile(log_path) {}
+
+        vector<ostream *> sinks(){
+            return {&std::cerr, &outfile, &outfile_fail, &logfile};
+        }
+        void emit(const candidate_fusion &fusion, const fusion_score &score, const scoring_context &context,
+                formatted_record &record) const{
+            if(score.pass_fail_code.find("PASS")!=string::npos){
+                text_buffer range_stream;
+                for(const auto &tup :fusion.median_range()){
+                    range_stream << std::get<0>(tup) << ":" << std::get<1>(tup) << "-" << std::get<2>(tup) << ";";
+                }
+                print_tsv(record[1], fusion.id, fusion.name, score.tfidf_score_full_len, score.fin_score, score.total_count,
+                        normal_count_list{fusion, context}, score.pass_fail_code, range_stream.text);
+
+                fusion.log(record[3]);
+            }
+            else{
+                print_tsv(record[2], fusion.id, fusion.name, score.tfidf_score_full_len, score.fin_score, score.total_count,
+                        normal_count_list{fusion, context}, score.pass_fail_code);
+            }
+        }
+        void commit(const candidate_fusion &, const fusion_score &){}
+    };
+
+    // All columns once per fusion on std::cout, the annotate_calls output. Batch samples use their own streams.
+    class legacy_stdout_output{
+        ostream &log;
+        ostream &out;
+
+        public:
+        legacy_stdout_output(ostream &log = std::cerr, ostream &out = std::cout) : log(log), out(out) {}
+        vector<ostream *> sinks(){
+            return {&log, &out};
+        }
+        void emit(const candidate_fusion &fusion, const fusion_score &score, const scoring_context &context,
+                formatted_record &record) const{
+            print_fusion_columns(record[1], fusion, score, context);
+            record[1] << "\n";
+        }
+        void commit(const candidate_fusion &, const fusion_score &){}
+    };
+
+    // Typed columnar table of one row per supporting read, for readers that map single columns
+    // (typhon/utils/genion_columns.py). Layout, sections 8 byte aligned: columnar_header,
+    // column_count columnar_column descriptors, then the column sections. int32 and float64 columns
+    // are arrays of row_count values. A string section is uint64 offsets[count + 1] relative to its
+    // end followed by the bytes; utf8 columns are one of row_count strings, dictionary columns
+    // uint32 codes plus a string section of their distinct values in order of first appearance.
+    const char columnar_magic[8] = {'G','N','C','O','L','T','A','B'};
+    const uint32_t columnar_version = 1;
+
+    struct columnar_header{
+        char magic[8];
+        uint32_t version;
+        uint32_t column_count;
+        uint64_t row_count;
+    };
+    struct columnar_column{
+        char name[32];
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t offset, length;                // values, codes of dictionary columns
+        uint64_t strings_offset, string_count;  // string section of utf8 and dictionary columns
+    };
+
+    // Directory part of path, "." for a bare file name
+    inline string parent_directory(const string &path){
+        size_t slash = path.rfind('/');
+        return slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    // Bytes of one section of a columnar_table. Up to spool_size of them are kept in memory, the
+    // rest goes to an unlinked temporary file, so large tables are built in bounded memory.
+    class columnar_section{
+        string directory;
+        string pending;
+        std::unique_ptr<spill_file> file;
+        uint64_t length {0};
+
+        static constexpr size_t spool_size = size_t(1) << 20;
+
+        public:
+        explicit columnar_section(const string &directory) : directory(directory) {}
+
+        void append(const void *data, size_t size){
+            pending.append(static_cast<const char *>(data), size);
+            length += size;
+            if(pending.size() >= spool_size){
+                if(file == NULL){
+                    file = std::make_unique<spill_file>(directory);
+                }
+                file->write(pending.data(), pending.size());
+                pending.clear();
+            }
+        }
+        uint64_t size() const{
+            return length;
+        }
+        // Writes the whole section to ost, false if the spooled part cannot be read back
+        bool copy_to(ostream &ost){
+            if(file != NULL){
+                file->rewind();
+                string block(spool_size, '\0');
+                for(uint64_t left = length - pending.size(); left > 0;){
+                    size_t size = std::min<uint64_t>(left, block.size());
+                    if(!file->read(&block[0], size)){
+                        std::cerr << "[ERROR] Cannot read back columnar table spool file" << std::endl;
+                        return false;
+                    }
+                    ost.write(block.data(), size);
+                    left -= size;
+                }
+            }
+            ost.write(pending.data(), pending.size());
+            return true;
+        }
+    };
+
+    class columnar_table{
+        public:
+        enum column_type : uint32_t { int32_column = 1, float64_column = 2, utf8_column = 3, dictionary_column = 4 };
+
+        class column{
+            public:
+            string name;
+            column_type type;
+            columnar_section values;         // int32, float64 or dictionary codes
+            columnar_section string_offsets; // utf8 only, the string section's offsets
+            columnar_section string_bytes;   // utf8 only
+            // Dictionary values in order of first appearance, small enough to stay in memory
+            std::deque<string> dictionary_values;
+            std::unordered_map<std::string_view, uint32_t> dictionary; // views of dictionary_values
+
+            column(const string &name, column_type type, const string &directory) :
+                    name(name), type(type), values(directory), string_offsets(directory), string_bytes(directory){
+                uint64_t first = 0;
+                string_offsets.append(&first, sizeof(first));
+            }
+            void add(int32_t value){
+                values.append(&value, sizeof(value));
+            }
+            void add(double value){
+                values.append(&value, sizeof(value));
+            }
+            void add(std::string_view value){
+                if(type == utf8_column){
+                    string_bytes.append(value.data(), value.size());
+                    uint64_t end = string_bytes.size();
+                    string_offsets.append(&end, sizeof(end));
+                    return;
+                }
+                auto iter = dictionary.find(value);
+                uint32_t code;
+                if(iter != dictionary.end()){
+                    code = iter->second;
+                }
+                else{
+                    code = dictionary_values.size();
+                    dictionary_values.emplace_back(value);
+                    dictionary.emplace(dictionary_values.back(), code);
+                }
+                values.append(&code, sizeof(code));
+            }
+            uint64_t string_count() const{
+                return type == utf8_column ? string_offsets.size() / sizeof(uint64_t) - 1 : dictionary_values.size();
+            }
+            uint64_t string_section_size() const{
+                if(type == utf8_column){
+                    return string_offsets.size() + string_bytes.size();
+                }
+                uint64_t bytes = 0;
+                for(const string &value : dictionary_values){
+                    bytes += value.size();
+                }
+                return (dictionary_values.size() + 1) * sizeof(uint64_t) + bytes;
+            }
+            // The string section of a dictionary column, built from its values
+            void write_dictionary(ostream &ost) const{
+                uint64_t end = 0;
+                ost.write(reinterpret_cast<const char *>(&end), sizeof(end));
+                for(const string &value : dictionary_values){
+                    end += value.size();
+                    ost.write(reinterpret_cast<const char *>(&end), sizeof(end));
+                }
+                for(const string &value : dictionary_values){
+                    ost.write(value.data(), value.size());
+                }
+            }
+        };
+
+        string directory; // of the spool files
+        vector<column> columns;
+        uint64_t row_count {0};
+
+        explicit columnar_table(const string &directory) : directory(directory) {}
+
+        size_t add_column(const string &name, column_type type){
+            assert(name.size() < sizeof(columnar_column::name));
+            columns.emplace_back(name, type, directory);
+            return columns.size() - 1;
+        }
+        bool write(const string &path){
+            std::ofstream ost(path, std::ios::binary);
+            if(!ost.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << path << std::endl;
+                return false;
+            }
+            vector<columnar_column> descriptors(columns.size());
+            uint64_t offset = sizeof(columnar_header) + columns.size() * sizeof(columnar_column);
+            auto place = [&offset] (uint64_t length) {
+                uint64_t start = offset;
+                offset += (length + 7) / 8 * 8;
+                return start;
+            };
+            for(size_t k = 0; k < columns.size(); ++k){
+                const column &c = columns[k];
+                columnar_column &d = descriptors[k];
+                std::memset(&d, 0, sizeof(d));
+                std::memcpy(d.name, c.name.data(), c.name.size());
+                d.type = c.type;
+                d.length = c.values.size();
+                d.offset = place(d.length);
+                if(c.type == utf8_column || c.type == dictionary_column){
+                    d.string_count = c.string_count();
+                    d.strings_offset = place(c.string_section_size());
+                }
+            }
+            columnar_header header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, columnar_magic, sizeof(header.magic));
+            header.version = columnar_version;
+            header.column_count = columns.size();
+            header.row_count = row_count;
+            ost.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            ost.write(reinterpret_cast<const char *>(descriptors.data()), descriptors.size() * sizeof(columnar_column));
+            const char padding[8] = {0};
+            auto pad = [&] (uint64_t length) {
+                ost.write(padding, (8 - length % 8) % 8);
+            };
+            for(column &c : columns){
+                if(!c.values.copy_to(ost)){
+                    return false;
+                }
+                pad(c.values.size());
+                if(c.type == utf8_column){
+                    if(!c.string_offsets.copy_to(ost) || !c.string_bytes.copy_to(ost)){
+                        return false;
+                    }
+                    pad(c.string_section_size());
+                }
+                else if(c.type == dictionary_column){
+                    c.write_dictionary(ost);
+                    pad(c.string_section_size());
                 }
             }
-
+            ost.close();
+            if(ost.fail()){
+                std::cerr << "[ERROR] Cannot write file: " << path << std::endl;
+                return false;
+            }
+            return true;
         }
-        return std::make_pair(total_normal_count,total_chimer_count);
-    }
-
+    };
 
-    std::unordered_map<string, SEQDIR>  read_read_directions(const string &path){
-        
-        std::unordered_map<string, SEQDIR> directions; 
-        std::ifstream dir_file(path);
-        string line;
+    // Fusion columns once per fusion in the output, like normalized_output, and a typed columnar
+    // table of one row per supporting read in <output>.cols, written by finish(). Rows are added by
+    // commit() in fusion order; columns past 1 MB are spooled to temporary files next to the table.
+    class columnar_output{
+        std::ofstream outfile;
+        std::ofstream outfile_fail;
+        std::ofstream logfile;
+        string table_path;
+        columnar_table table;
 
-        while(std::getline(dir_file, line)){
-            vector<string> fields = rsplit(line,"\t");
-            if(fields[1] =="NONE"){
-                directions[fields[0]] = SEQDIR::unknown;
-                continue;
-            }
-            if(fields[1] == "A" && stoi(fields[2]) > 50){
-                directions[fields[0]] = SEQDIR::reverse;
+        public:
+        columnar_output(const string &output_path, const string &log_path) :
+                outfile(output_path), outfile_fail(output_path + ".fail"), logfile(log_path),
+                table_path(output_path + ".cols"), table(parent_directory(table_path)){
+            for(const char *name : {"fusion_id", "fusion_name", "pass_fail"}){
+                table.add_column(name, columnar_table::dictionary_column);
             }
-            else if (fields[1] == "T" && stoi(fields[2]) < 50){
-                directions[fields[0]] = SEQDIR::forward;
+            for(const char *name : {"forward_support", "backward_support", "multi_first_exon", "no_first_exon",
+                    "gene_overlaps", "segdup_count", "total_count", "null_rejected"}){
+                table.add_column(name, columnar_table::int32_column);
             }
-            else{
-                directions[fields[0]] = SEQDIR::unknown;
+            for(const char *name : {"fin_score", "tfidf_score", "tfidf_score_full_length", "pvalue", "corrected_pvalue"}){
+                table.add_column(name, columnar_table::float64_column);
             }
+            table.add_column("read_id", columnar_table::utf8_column);
         }
-        return directions;
-    }
 
-    bool is_cluster_rt( const candidate_fusion &cf, double fin,
-            double forw_rt_ex, double back_rt_ex,
-            int max_rt_distance = 50000, double max_fin = 0.1){
-        
-        const candidate_read *read = NULL;
-        if( cf.forward.size() > 0){
-            read = &cf.forward[0];
+        vector<ostream *> sinks(){
+            return {&std::cerr, &outfile};
         }
-        else if( cf.backward.size()){
-            read = &cf.backward[0];
+        void emit(const candidate_fusion &fusion, const fusion_score &score, const scoring_context &context,
+                formatted_record &record) const{
+            print_fusion_columns(record[1], fusion, score, context);
+            record[1] << "\n";
         }
-        else if( cf.multi_first.size()){
-            read = &cf.multi_first[0];
+        void commit(const candidate_fusion &fusion, const fusion_score &score){
+            const std::array<std::string_view, 3> strings{fusion.id, fusion.name, score.pass_fail_code};
+            const std::array<int32_t, 8> ints{static_cast<int32_t>(fusion.read_count(read_category::forward)),
+                static_cast<int32_t>(fusion.read_count(read_category::backward)),
+                static_cast<int32_t>(fusion.read_count(read_category::multi_first)),
+                static_cast<int32_t>(fusion.read_count(read_category::no_first)),
+                static_cast<int32_t>(fusion.gene_overlaps.size()), static_cast<int32_t>(fusion.duplications.size()),
+                score.total_count, score.null_rejected};
+            const std::array<double, 5> doubles{score.fin_score, score.tfidf_score, score.tfidf_score_full_len,
+                score.pvalue, score.corr_pvalue};
+            for(const auto &cr : fusion.reads({read_category::forward, read_category::backward,
+                    read_category::multi_first, read_category::no_first})){
+                size_t k = 0;
+                for(std::string_view value : strings){
+                    table.columns[k++].add(value);
+                }
+                for(int32_t value : ints){
+                    table.columns[k++].add(value);
+                }
+                for(double value : doubles){
+                    table.columns[k++].add(value);
+                }
+                table.columns[k].add(std::string_view(cr.read_id));
+                ++table.row_count;
+            }
         }
-        else if( cf.no_first.size()){
-            read = &cf.no_first[0];
+        // Writes the table, false (with the error printed) if it could not be written completely
+        bool finish(){
+            return table.write(table_path);
         }
-        else{
-            return false;
+    };
+
+    // Compact row of a pruned fusion: id, name, forward, backward, multi first exon and no first exon
+    // read counts, p-value, corrected p-value, FAIL:lowsup and the comma separated ids of its reads,
+    // in the per read output's order
+    void print_pruned_fusion(text_buffer &out, const candidate_fusion &fusion, double pvalue, double corr_pvalue){
+        out << fusion.id << "\t" << fusion.name << "\t" << fusion.read_count(read_category::forward)
+            << "\t" << fusion.read_count(read_category::backward) << "\t" << fusion.read_count(read_category::multi_first)
+            << "\t" << fusion.read_count(read_category::no_first) << "\t" << pvalue << "\t" << corr_pvalue
+            << "\tFAIL:lowsup\t";
+        const char *separator = "";
+        for(const auto &cr : fusion.reads({read_category::forward, read_category::backward,
+                read_category::multi_first, read_category::no_first})){
+            out << separator << cr.read_id;
+            separator = ",";
         }
-        //vector<std::pair<interval, exon> > blocks;
-    
-        if( read->blocks.size() < 2){
-            return false;
+        out << "\n";
+    }
+
+    // Tests, scores and classifies every fusion of context.fm and writes them with output, in fusion id order.
+    // A sharded output pass takes the tests from correction instead. Pruned fusions are tested with the
+    // others, so the correction is the same, and written to pruned_summary with print_pruned_fusion.
+    template<class Output>
+    void classify_fusions(const scoring_context &context, double mean_chimera_ratio, size_t thread_count, Output &&output,
+            stage_profiler *profiler = NULL, const shard_correction *correction = NULL, ostream *pruned_summary = NULL){
+        stage_profiler disabled;
+        stage_profiler &profile = profiler != NULL ? *profiler : disabled;
+        profile.begin("hypothesis_testing");
+        vector<const candidate_fusion *> fusions = context.fm.sorted_fusions();
+        vector<double> pvalues;
+        vector<double> corr_pvalues;
+        vector<bool> null_rejected;
+        if(correction == NULL){
+            pvalues = statistically_test_candidates(fusions, mean_chimera_ratio, context.normal_counts, thread_count);
+            auto hypothesis = multiple_test(pvalues, fusion_test_alpha, pvalue_corrector::BENJAMINI_YEKUTIELI);
+            corr_pvalues = hypothesis.corr_pvals;
+            null_rejected.assign(hypothesis.null_rejected.begin(), hypothesis.null_rejected.end());
         }
-        auto &blocks = read->blocks;
-        size_t i = 0;
-        for( i=1; i < blocks.size(); ++i){
-            if( blocks[i].second.gene_id != blocks[i-1].second.gene_id){
-                break;
+        else{
+            for(const candidate_fusion *fusion : fusions){
+                size_t k = correction->find(fusion->id);
+                if(k == correction->ids.size()){
+                    throw annotate_error("Fusion " + fusion->id + " is not in the shard correction, was it built from this input?");
+                }
+                pvalues.push_back(correction->pvalues[k]);
+                corr_pvalues.push_back(correction->corr_pvalues[k]);
+                null_rejected.push_back(correction->null_rejected[k]);
             }
         }
+        profile.count("fusions", fusions.size());
 
-        auto b1 = blocks[i-1];
-        auto b2 = blocks[i];
-
-        if( b1.second.range.chr != b2.second.range.chr){
-            return false;
-        }
-        std::array<int, 4> positions {{ b1.second.range.start, b1.second.range.end,  b2.second.range.start, b2.second.range.end}};
-        std::sort(positions.begin(),positions.end());
-        int distance = positions[2] - positions[1];
-        if( distance > max_rt_distance){
-            return false;
-        }
-        if( forw_rt_ex < 0.8 || back_rt_ex < 0.8){
-            return false;
-        }
-        if( fin > max_fin){
-            return false;
+        profile.begin("classification_output");
+        vector<ostream *> sinks = output.sinks();
+        size_t pruned_stream = sinks.size();
+        if(pruned_summary != NULL){
+            sinks.push_back(pruned_summary);
         }
-
-        return true;
+        using scored_record = slotted_record<fusion_score>;
+        size_t bytes_written = 0;
+        context.fm.for_each_read_range(fusions, [&] (size_t first, size_t last) {
+            bytes_written += format_records_in_order<scored_record>(last - first, thread_count, sinks,
+                    [&] (size_t offset, scored_record &record) {
+                size_t index = first + offset;
+                if(fusions[index]->pruned){
+                    assert(pruned_summary != NULL);
+                    print_pruned_fusion(record[pruned_stream], *fusions[index], pvalues[index], corr_pvalues[index]);
+                    return;
+                }
+                record.slot = fusion_score(); // reused across batches
+                fusion_score &score = record.slot;
+                score.null_rejected = null_rejected[index];
+                score.pvalue = pvalues[index];
+                score.corr_pvalue = corr_pvalues[index];
+                score_fusion(*fusions[index], context, score, record[0]);
+                output.emit(*fusions[index], score, context, record);
+            }, [&] (size_t offset, const scored_record &record) {
+                if(!fusions[first + offset]->pruned){
+                    output.commit(*fusions[first + offset], record.slot);
+                }
+            });
+        });
+        profile.count("bytes_written", bytes_written);
+        profile.end();
     }
-   
-    double statistically_test_candidate(const candidate_fusion &fusion,
-            double chimera_rate,
-            const std::unordered_map<string, size_t> &gene_counts
-            ){
-
-            
-        vector<string> genes = rsplit(fusion.id,"::");
-        vector<size_t> normal_counts;
-        for(const string &gene : genes){
 
-            auto count_ptr = gene_counts.find(gene);
-            size_t count = 0;
-            if(count_ptr != gene_counts.end()){
-                count = count_ptr->second;
-            }
-            normal_counts.push_back(count);
+    // Runs an entry point, exiting on an annotate_error as on any other input error
+    template<class F>
+    int exit_on_annotate_error(F run){
+        try{
+            return run();
+        }
+        catch(const annotate_error &e){
+            std::cerr << "[ERROR] " << e.what() << std::endl;
+            exit(-1);
         }
-
-        size_t mult_count = std::accumulate(normal_counts.begin(), normal_counts.end(), 1L, std::multiplies<size_t>());
-        double average_normal_count = std::pow(static_cast<double>(mult_count), 1.0/normal_counts.size());
-
-        int x = fusion.total_count();
-        int n = x + average_normal_count;
-        int m = x + chimera_rate * average_normal_count;
-        int N = 2 * n; 
-        double pvalue = hyper_geom_cdf(x,n,m,N);
-        
-        return pvalue;
     }
 
-    int annotate_calls_direct( 
+    int run_annotate_calls_direct(
             const string &output_path,
             const string &log_path,
             const string &gtf_path,
@@ -1034,11 +4096,13 @@ namespace annotate{
             bool only_coding){
 
         bool full_debug_output = true;
+        annotate_settings settings = annotate_settings::from_environment();
 
-        std::unordered_map<string, gene> gene_annot = read_gene_annotation(gtf_path);
-        
-        std::unordered_map<string, int> last_exons = read_last_exons(gtf_path);        //May be removed.
-        std::unordered_map<string, int> transcript_exon_counts = read_transcript_exon_counts(gtf_path);
+        stage_profiler profiler(settings.profile);
+        annotation_reference ref;
+        bool footprint_duplications = settings.segdup_footprint && settings.annotation_cache == "";
+        load_reference(ref, gtf_path, duplication_path, settings.annotation_cache, settings.threads, !footprint_duplications,
+                &profiler);
         /*
         vector<candidate_read> candidate_reads;
         for( const Candidate &cand: candidates){
@@ -1049,364 +4113,447 @@ namespace annotate{
             candidate_reads.push_back(cr);
         };
        */ 
-        fusion_manager fm{candidates, gene_annot, transcript_exon_counts};
+        profiler.begin("fusion_manager_build");
+        fusion_manager fm{candidates, ref.gtf, settings.low_memory, settings.spill_directory};
 //        for( auto &cand : candidate_reads){
 //            fm.add_read(cand, gene_annot, transcript_exon_counts);
 //        }
+        profiler.count("reads", candidates.size());
+        profiler.count("fusions", fm.fusions.size());
+        std::ofstream pruned_file;
+        if(settings.prune_low_support){
+            profiler.begin("low_support_prune");
+            profiler.count("pruned_fusions", fm.prune_low_support(min_support));
+            pruned_file.open(output_path + ".pruned");
+            if(!pruned_file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << output_path << ".pruned" << std::endl;
+                exit(-1);
+            }
+        }
+        ostream *pruned_summary = settings.prune_low_support ? &pruned_file : NULL;
+        if(footprint_duplications){
+            profiler.begin("segdup_load");
+            ref.duplications = read_footprint_duplications(duplication_path, fm, settings.threads);
+            profiler.count("segdups", ref.duplications.size());
+        }
         
-        annotate_duplications_and_overlaps(fm, gene_annot, duplication_path);
+        profiler.begin("duplication_overlap_annotation");
+        profiler.count("iitree_queries", annotate_duplications_and_overlaps(fm, ref.gtf, ref.duplications, settings.threads));
+        profiler.end();
+        vector<size_t> normal_counts = index_gene_counts(gene_counts);
         
 
         double mean_chimera_ratio = static_cast<double>(total_chimer_count) / total_normal_count;
 
 
-        vector<double> pvalues;
-        for( const auto &cand : fm.fusions){
-            double pvalue = statistically_test_candidate(cand.second, mean_chimera_ratio, gene_counts);
-            pvalues.push_back(pvalue);
-        }
-        auto hypothesis = multiple_test(pvalues, 0.05, pvalue_corrector::BENJAMINI_YEKUTIELI);
-
-
-
-        std::ofstream outfile( output_path );
-        std::ofstream logfile( log_path );
-        std::ofstream outfile_fail( output_path + ".fail");
-
-        auto pval_iter = pvalues.begin();
-        auto corr_pval_iter = hypothesis.corr_pvals.begin();
-        auto null_iter = hypothesis.null_rejected.begin();
-        for( const auto &cand : fm.fusions){
-            string fusion_id = cand.first;
-            bool null_rejected = *null_iter;
-            double pvalue = *pval_iter;
-            double corr_pvalue = *corr_pval_iter;
-            pval_iter = std::next(pval_iter);
-            corr_pval_iter = std::next(corr_pval_iter);
-            null_iter = std::next(null_iter);
-            int total_count = cand.second.total_count();
-
-            int total_count_putative_full_length = cand.second.forward.size() 
-                + cand.second.backward.size();
-            vector<string> genes = rsplit(fusion_id,"::");
-
-            bool coding_flag = false;
-            if( only_coding){
-                for( const string &g : genes){
-                    auto gptr = gene_annot.find(g);
-                    if(gptr == gene_annot.end()){
-                        std::cerr << "Gene " << g << " is not in annotation!\n";
-                        continue;
-                    }
-                    if(gptr->second.coding == false){
-                        coding_flag = true;
-                        break;
-                    }
-                }
-            }
-            double gene_count_sum = 0;
-            string gene_count_string = "";
-            string idf_string = "";
-            double total_idf = 0;
-            for(const string &gene : genes){
-                gene_count_sum += gene_counts[gene];
-                gene_count_string+= std::to_string(gene_counts[gene]) + ";";
-                idf_string+= std::to_string(fm.gene_counts[gene]-total_count) + ";";
-                total_idf+= fm.gene_counts[gene] - total_count;
-            }
-            
-            double tfidf_score = total_count * std::log(fm.fusions.size()/(1+total_idf/2));
-            double tfidf_score_full_len = total_count_putative_full_length * std::log(fm.fusions.size()/(1+total_idf/2));
-            
-            int tcpflnz;
-            if(total_count == 0){
-                tcpflnz = 1;
-            }
-            else{
-                tcpflnz = total_count;
-            }
-
-            double fin_score = genes.size() * total_count / (gene_count_sum+1);
-
-            double fg_count = cand.second.non_covered_sum_ratio.at(genes[0]);
-            double lg_count = cand.second.non_covered_sum_ratio.at(genes[1]);
-            double forward_rt_ex  =  1.0 * fg_count / tcpflnz;
-            double backward_rt_ex = 1.0 * lg_count / tcpflnz;
-            double bad_strand_ratio = static_cast<double>(cand.second.invalid)/cand.second.total_count();
-            string pass_fail_code = "";
-            if(coding_flag){
-                pass_fail_code += ":noncoding";
-            }
-
-            if(cand.second.gene_overlaps.size() > 0){
-                pass_fail_code += ":overlaps";
-            }
-            if(cand.second.duplications.size() > 0){
-                pass_fail_code += ":segdup";
-            }
-            if(bad_strand_ratio > 0.25){
-                pass_fail_code += ":badstrand";
-            }
-            if( cand.second.forward.size() + cand.second.backward.size() 
-                    + cand.second.multi_first.size() < min_support){
-                pass_fail_code += ":lowsup";
-            }
-            if( pass_fail_code != ""){
-                pass_fail_code = "FAIL" + pass_fail_code;
-            }
-            else{
-                if( is_cluster_rt( cand.second, fin_score, forward_rt_ex, backward_rt_ex, 
-                            maxrtdistance, maxrtfin)){
-                    pass_fail_code = "PASS:RT";
-                }
-                else if( null_rejected){
-                    pass_fail_code = "PASS:GF";
-                }
-                else{
-                    pass_fail_code = "FAIL:RP";
-                }
-            }
-
-            if(full_debug_output){ 
-                // Collect all read_ids
-                std::vector<std::string> all_read_ids;
-                for(const auto& cr : cand.second.forward) all_read_ids.push_back(cr.read_id);
-                for(const auto& cr : cand.second.backward) all_read_ids.push_back(cr.read_id);
-                for(const auto& cr : cand.second.multi_first) all_read_ids.push_back(cr.read_id);
-                for(const auto& cr : cand.second.no_first) all_read_ids.push_back(cr.read_id);
-                // Output one line per read_id
-                for(const auto& read_id : all_read_ids) {
-                    outfile << fusion_id << "\t" << cand.second.forward.size() << "\t"
-                        << cand.second.backward.size()  << "\t"
-                        << cand.second.multi_first.size() << "\t" << cand.second.no_first.size()
-                        << "\t" <<  cand.second.gene_overlaps.size() 
-                        << "\t" <<  cand.second.duplications.size()
-                        << "\t" << cand.second.name << "\t" << fin_score
-                        << "\t" <<  pass_fail_code
-                        << "\t" << gene_count_sum << "\t" << total_count <<  "\t"  << gene_count_string << "\t"
-                        << total_count_putative_full_length << "\t" << genes.size() * total_count_putative_full_length / ( gene_count_sum + 1)
-                        << "\t" <<  total_idf << "\t" << idf_string << "\t" << tfidf_score << "\t" << tfidf_score_full_len
-                        << "\t" << fg_count  << "\t" << lg_count << "\t"
-                        << forward_rt_ex << "\t" << backward_rt_ex << "\t"
-                        << pvalue << "\t" << corr_pvalue << "\t" << (null_rejected?"pPASS":"pFAIL") 
-                        << "\t" << static_cast<double>(cand.second.invalid)/cand.second.total_count() 
-                        << "\t" << read_id << "\n";
-                }
-            }
-            else{
-                if(pass_fail_code.find("PASS")!=string::npos){
-                    std::stringstream range_stream;
-                    for(const auto &tup :cand.second.median_range()){
-                        range_stream << std::get<0>(tup) << ":" << std::get<1>(tup) << "-" << std::get<2>(tup) << ";";
-                    }
-                    print_tsv(outfile, fusion_id, cand.second.name, tfidf_score_full_len, fin_score, total_count, gene_count_string, pass_fail_code, range_stream.str());
-
-                    cand.second.log(logfile);
-                }
-                else{
-                    print_tsv(outfile_fail, fusion_id, cand.second.name, tfidf_score_full_len, fin_score, total_count, gene_count_string, pass_fail_code);
-
-                }
+        scoring_context context{fm, ref.gtf, normal_counts, min_support, only_coding, maxrtdistance, maxrtfin};
+        if(!full_debug_output){
+            classify_fusions(context, mean_chimera_ratio, settings.threads, pass_fail_output(output_path, log_path), &profiler,
+                    NULL, pruned_summary);
+        }
+        else if(settings.columnar_output){
+            columnar_output output(output_path, log_path);
+            classify_fusions(context, mean_chimera_ratio, settings.threads, output, &profiler, NULL, pruned_summary);
+            if(!output.finish()){
+                exit(-1);
             }
         }
-       
+        else if(settings.normalized_output){
+            classify_fusions(context, mean_chimera_ratio, settings.threads, normalized_output(output_path, log_path), &profiler,
+                    NULL, pruned_summary);
+        }
+        else{
+            classify_fusions(context, mean_chimera_ratio, settings.threads, per_read_output(output_path, log_path), &profiler,
+                    NULL, pruned_summary);
+        }
+        profiler.write_json(output_path + ".profile.json", settings.threads);
 
         return 0;  
     }
-       
-
-    int annotate_calls(int argc, char **argv){
-        auto  opt = parse_args(argc, argv);
-
-        size_t min_support = opt["minsupport"].as<size_t>();
-
-        string input_prefix(opt["input"].as<string>());
-        string reference_path(opt["reference"].as<string>());
 
-        bool filter_non_coding = !opt["c"].as<bool>();
-
-        string gtf_path = reference_path + "/1.gtf";
-        std::unordered_map<string, gene> gene_annot = read_gene_annotation(gtf_path);
-        
-
-        std::unordered_map<string, int> last_exons = read_last_exons(gtf_path);        //May be removed.
-        std::unordered_map<string, int> transcript_exon_counts = read_transcript_exon_counts(gtf_path);
+    int annotate_calls_direct(
+            const string &output_path,
+            const string &log_path,
+            const string &gtf_path,
+            const string &duplication_path,
+            const vector<Candidate> &candidates,
+            std::unordered_map<string, size_t> gene_counts,
+            size_t min_support,
+            int total_normal_count, int total_chimer_count,
+            int maxrtdistance,      double maxrtfin,
+            bool only_coding){
+        return exit_on_annotate_error([&] {
+            return run_annotate_calls_direct(output_path, log_path, gtf_path, duplication_path, candidates,
+                    std::move(gene_counts), min_support, total_normal_count, total_chimer_count, maxrtdistance,
+                    maxrtfin, only_coding);
+        });
+    }
+       
 
+    // The filter stage writes chains.fixed.txt, which may have been compressed since
+    string chains_input_path(const string &input_prefix){
         string chains_path = input_prefix + "/chains.fixed.txt";
+        if(access(chains_path.c_str(), F_OK) != 0 && access((chains_path + ".gz").c_str(), F_OK) == 0){
+            chains_path += ".gz";
+        }
+        return chains_path;
+    }
 
-        vector<candidate_read> candidates;
+    // Options of annotate_calls that apply to every sample
+    struct calls_settings{
+        size_t min_support;
+        bool only_coding;
+        long maxrtdistance;
+        double maxrtfin;
+        bool profile;
+        bool low_memory;
+        string spill_directory;
+        bool breakpoint_clusters;
+        int breakpoint_window;
+        bool prune_low_support;
+    };
 
-        std::ifstream chain_file(chains_path);
-        
-        string line;
-        while(std::getline(chain_file, line)){
-            vector<string> fields =  rsplit(line, "\t");
-            int block_count = stoi(fields[1]);
-            candidate_read cr(fields[0]);
-            for(int i = 0; i < block_count; ++i){
-                std::getline(chain_file, line);
-                cr.add_block(line);
+    // Annotates the filter stage output in input_prefix against ref. Scored fusions go to calls, breakpoints
+    // to output_path/breakpoints.tsv. A footprint_duplication_path replaces ref's segdups with the ones near this sample's fusions.
+    // With an output pass shard only the shard's fusions are annotated. Prints the error and returns false
+    // when an output cannot be opened; the helpers it calls throw annotate_error.
+    bool annotate_sample(const annotation_reference &ref, const string &input_prefix, const string &output_path,
+            const calls_settings &settings, size_t threads, ostream &log, ostream &calls,
+            stage_profiler &profiler, const string &footprint_duplication_path = "", const fusion_shard *shard = NULL){
+        string chains_path = chains_input_path(input_prefix);
+
+        // Reads are added to their fusions as each chunk is parsed, so parsing and the fusion_manager build are one stage
+        profiler.begin("chain_parse");
+        fusion_manager fm(settings.low_memory, settings.spill_directory);
+        if(shard != NULL){
+            fm.keep_only([shard] (const string &fusion_id) { return shard->owns(fusion_id); });
+        }
+        if(settings.breakpoint_clusters){
+            fm.collect_breakpoint_histograms();
+        }
+        profiler.count("reads", read_chains(chains_path, ref.gtf, fm, threads));
+        profiler.count("fusions", fm.fusions.size());
+        std::ofstream pruned_file;
+        if(settings.prune_low_support){
+            profiler.begin("low_support_prune");
+            profiler.count("pruned_fusions", fm.prune_low_support(settings.min_support));
+            string pruned_path = output_path + "/pruned.tsv";
+            pruned_file.open(pruned_path);
+            if(!pruned_file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << pruned_path << std::endl;
+                return false;
             }
-            candidates.push_back(cr);
         }
-
-        chain_file.close();
-        fusion_manager fm;
-        for( auto &cand : candidates){
-            fm.add_read(cand, gene_annot, transcript_exon_counts);
-            //fm.add_read(cand, gene_annot, last_exons, read_directions);
+        duplication_tree sample_duplications;
+        if(footprint_duplication_path != ""){
+            profiler.begin("segdup_load");
+            sample_duplications = read_footprint_duplications(footprint_duplication_path, fm, threads);
+            profiler.count("segdups", sample_duplications.size());
         }
+        const duplication_tree &duplications = footprint_duplication_path != "" ? sample_duplications : ref.duplications;
         
-        annotate_duplications_and_overlaps(fm, gene_annot, opt["duplications"].as<string>());
+        profiler.begin("duplication_overlap_annotation");
+        profiler.count("iitree_queries", annotate_duplications_and_overlaps(fm, ref.gtf, duplications, threads));
         
+        profiler.begin("gene_count_load");
         string feature_table_path = input_prefix + "/feature_table.tsv";
 
         std::unordered_map<string, size_t> gene_counts;
         auto[total_normal_count,total_chimer_count] = count_genes(feature_table_path, gene_counts, false);
+        vector<size_t> normal_counts = index_gene_counts(gene_counts);
         double mean_chimera_ratio = static_cast<double>(total_chimer_count) / total_normal_count;
 
 
-        vector<double> pvalues;
-        for( const auto &cand : fm.fusions){
-            double pvalue = statistically_test_candidate(cand.second, mean_chimera_ratio, gene_counts);
-            pvalues.push_back(pvalue);
-        }
-        auto hypothesis = multiple_test(pvalues, 0.05, pvalue_corrector::BENJAMINI_YEKUTIELI);
-
-        auto pval_iter = pvalues.begin();
-        auto corr_pval_iter = hypothesis.corr_pvals.begin();
-        auto null_iter = hypothesis.null_rejected.begin();
-        for( const auto &cand : fm.fusions){
-            bool null_rejected = *null_iter;
-            double pvalue = *pval_iter;
-            double corr_pvalue = *corr_pval_iter;
-            pval_iter = std::next(pval_iter);
-            corr_pval_iter = std::next(corr_pval_iter);
-            null_iter = std::next(null_iter);
-            int total_count = cand.second.total_count();
-
-            int total_count_putative_full_length = cand.second.forward.size() 
-                + cand.second.backward.size();
-            vector<string> genes = rsplit(cand.first,"::");
-
-            bool coding_flag = false;
-            if( filter_non_coding){
-                for( const string &g : genes){
-                    auto gptr = gene_annot.find(g);
-                    if(gptr == gene_annot.end()){
-                        std::cerr << "Gene " << g << " is not in annotation!\n";
-                        continue;
-                    }
-                    if(gptr->second.coding == false){
-                        coding_flag = true;
-                        break;
+        const shard_correction *correction = shard != NULL ? shard->correction : NULL;
+        scoring_context context{fm, ref.gtf, normal_counts, settings.min_support, settings.only_coding,
+            settings.maxrtdistance, settings.maxrtfin, correction != NULL ? correction->ids.size() : 0};
+        classify_fusions(context, mean_chimera_ratio, threads, legacy_stdout_output(log, calls), &profiler, correction,
+                settings.prune_low_support ? &pruned_file : NULL);
+       
+        profiler.begin("breakpoint_output");
+        string bp_file_path = output_path + "/breakpoints.tsv";
+
+        std::ofstream bp_file(bp_file_path);
+        if(!bp_file.is_open()){
+            std::cerr << "[ERROR] Cannot open file: " << bp_file_path << std::endl;
+            return false;
+        }
+        vector<const candidate_fusion *> fusions = fm.sorted_fusions();
+
+        size_t bytes_written = 0;
+        fm.for_each_read_range(fusions, [&] (size_t first, size_t last) {
+            bytes_written += format_in_order(last - first, threads, {&bp_file}, [&] (size_t offset, formatted_record &record) {
+                text_buffer &bp_file = record[0];
+                const candidate_fusion &fusion = *fusions[first + offset];
+                const string &fusion_id = fusion.id;
+                if(fusion.pruned){
+                    return;
+                }
+
+                bool is_forward = true;
+                for(read_category category : {read_category::forward, read_category::backward}){//, read_category::no_first, read_category::multi_first}){
+                    for(const read_ref &fus : fusion.reads({category})){
+                        for(const auto &bp_pair : fus.get_breakpoints(is_forward)){
+
+                            bp_file << fus.read_id <<"\t" << fusion_id << "\t" << gene_symbols.name(bp_pair.first) << "\t" << bp_pair.second << "\n";
+                        }
                     }
+                    is_forward = false;
                 }
+            });
+        });
+        bp_file.close();
+        profiler.count("bytes_written", bytes_written);
+
+        if(settings.breakpoint_clusters){
+            profiler.begin("breakpoint_cluster_output");
+            string cluster_path = output_path + "/breakpoint_clusters.tsv";
+            std::ofstream cluster_file(cluster_path);
+            if(!cluster_file.is_open()){
+                std::cerr << "[ERROR] Cannot open file: " << cluster_path << std::endl;
+                return false;
             }
-            double gene_count_sum = 0;
-            string gene_count_string = "";
-            string idf_string = "";
-            double total_idf = 0;
-            for(const string &gene : genes){
-                gene_count_sum += gene_counts[gene];
-                gene_count_string+= std::to_string(gene_counts[gene]) + ";";
-                idf_string+= std::to_string(fm.gene_counts[gene]-total_count) + ";";
-                total_idf+= fm.gene_counts[gene] - total_count;
-            }
-            
-            double tfidf_score = total_count * std::log(fm.fusions.size()/(1+total_idf/2));
-            double tfidf_score_full_len = total_count_putative_full_length * std::log(fm.fusions.size()/(1+total_idf/2));
-            
-            int tcpflnz;
-            if(total_count == 0){
-                tcpflnz = 1;
-            }
-            else{
-                tcpflnz = total_count;
-            }
+            bytes_written = format_in_order(fusions.size(), threads, {&cluster_file}, [&] (size_t index, formatted_record &record) {
+                const candidate_fusion &fusion = *fusions[index];
+                if(fusion.pruned){
+                    return;
+                }
+                for(const auto &gene_histogram : fusion.breakpoint_histograms){
+                    const string &chr = chromosome_symbols.name(gene_histogram.second.chr);
+                    for(const auto &cluster : gene_histogram.second.clusters(settings.breakpoint_window)){
+                        record[0] << fusion.id << "\t" << gene_symbols.name(gene_histogram.first) << "\t" << chr << "\t"
+                            << cluster.mode << "\t" << cluster.spread << "\t" << cluster.support << "\n";
+                    }
+                }
+            });
+            profiler.count("bytes_written", bytes_written);
+        }
+        profiler.write_json(output_path + "/profile.json", threads);
+        return true;
+    }
+
+    // Test pass of a sharded run: writes the id and p-value of each fusion shard owns to pvalue_path
+    bool test_shard(const annotation_reference &ref, const string &input_prefix, const string &pvalue_path,
+            const calls_settings &settings, size_t threads, const fusion_shard &shard){
+        fusion_manager fm(settings.low_memory, settings.spill_directory);
+        fm.keep_only([&shard] (const string &fusion_id) { return shard.owns(fusion_id); });
+        read_chains(chains_input_path(input_prefix), ref.gtf, fm, threads);
+
+        std::unordered_map<string, size_t> gene_counts;
+        auto[total_normal_count,total_chimer_count] = count_genes(input_prefix + "/feature_table.tsv", gene_counts, false);
+        vector<size_t> normal_counts = index_gene_counts(gene_counts);
+        double mean_chimera_ratio = static_cast<double>(total_chimer_count) / total_normal_count;
 
-            double fin_score = genes.size() * total_count / (gene_count_sum+1);
+        vector<const candidate_fusion *> fusions = fm.sorted_fusions();
+        vector<double> pvalues = statistically_test_candidates(fusions, mean_chimera_ratio, normal_counts, threads);
+        std::ofstream file(pvalue_path);
+        if(!file.is_open()){
+            std::cerr << "[ERROR] Cannot open file: " << pvalue_path << std::endl;
+            return false;
+        }
+        file << std::setprecision(17);
+        for(size_t i = 0; i < fusions.size(); ++i){
+            file << fusions[i]->id << "\t" << pvalues[i] << "\n";
+        }
+        return static_cast<bool>(file);
+    }
 
-            double fg_count = cand.second.non_covered_sum_ratio.at(genes[0]);
-            double lg_count = cand.second.non_covered_sum_ratio.at(genes[1]);
-            double forward_rt_ex  =  1.0 * fg_count / tcpflnz;
-            double backward_rt_ex = 1.0 * lg_count / tcpflnz;
-            double bad_strand_ratio = static_cast<double>(cand.second.invalid)/cand.second.total_count();
-            string pass_fail_code = "";
-            if(coding_flag){
-                pass_fail_code += ":noncoding";
+    // One sample per line of a batch manifest: input path and output path, tab separated. Empty and # lines are skipped.
+    struct batch_sample{
+        string input_prefix;
+        string output_path;
+    };
+
+    // Prints the error and returns false for unreadable or malformed manifests
+    bool read_batch_manifest(const string &path, vector<batch_sample> &samples){
+        std::ifstream manifest(path);
+        if(!manifest.is_open()){
+            std::cerr << "[ERROR] Cannot open file: " << path << std::endl;
+            return false;
+        }
+        vector<std::string_view> fields;
+        string line;
+        while(std::getline(manifest, line)){
+            std::string_view trimmed = trim(line);
+            if(trimmed.empty() || trimmed[0] == '#'){
+                continue;
+            }
+            split_fields(trimmed, '\t', fields);
+            if(fields.size() < 2){
+                std::cerr << "[ERROR] Batch manifest line needs an input and an output path: " << line << std::endl;
+                return false;
             }
+            samples.push_back({string(trim(fields[0])), string(trim(fields[1]))});
+        }
+        return true;
+    }
 
-            if(cand.second.gene_overlaps.size() > 0){
-                pass_fail_code += ":overlaps";
+    // Annotates every manifest sample against one loaded reference, batch_jobs samples at a time.
+    // Each sample writes calls.tsv, calls.log and breakpoints.tsv in its output path. A sample that
+    // fails, also by an exception such as a transcript missing from ref, fails alone; returns 1 if any did.
+    int annotate_batch(const annotation_reference &ref, const vector<batch_sample> &samples,
+            const calls_settings &settings, size_t threads, size_t batch_jobs){
+        size_t jobs = worker_count(samples.size(), batch_jobs);
+        size_t sample_threads = std::max<size_t>(1, threads / jobs);
+        std::atomic<int> failed{0};
+        parallel_for(samples.size(), jobs, [&] (size_t i) {
+            const batch_sample &sample = samples[i];
+            std::ofstream calls(sample.output_path + "/calls.tsv");
+            std::ofstream log(sample.output_path + "/calls.log");
+            if(!calls.is_open() || !log.is_open()){
+                std::cerr << ("[ERROR] Cannot open file: " + sample.output_path + "/calls.tsv\n");
+                ++failed;
+                return;
             }
-            if(cand.second.duplications.size() > 0){
-                pass_fail_code += ":segdup";
+            stage_profiler profiler(settings.profile);
+            try{
+                if(!annotate_sample(ref, sample.input_prefix, sample.output_path, settings, sample_threads, log, calls, profiler)){
+                    ++failed;
+                }
             }
-            if(bad_strand_ratio > 0.25){
-                pass_fail_code += ":badstrand";
+            catch(const std::exception &e){
+                std::cerr << ("[ERROR] Sample " + sample.input_prefix + " failed: " + e.what() + "\n");
+                ++failed;
             }
-            if( cand.second.forward.size() + cand.second.backward.size() 
-                    + cand.second.multi_first.size() < min_support){
-                pass_fail_code += ":lowsup";
+        });
+        return failed == 0 ? 0 : 1;
+    }
+
+    // Names of the <name>.job files in job_dir, in name order
+    vector<string> pending_jobs(const string &job_dir){
+        vector<string> jobs;
+        DIR *dir = opendir(job_dir.c_str());
+        if(dir == NULL){
+            return jobs;
+        }
+        const string suffix = ".job";
+        for(dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)){
+            string name = entry->d_name;
+            if(name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0){
+                jobs.push_back(name.substr(0, name.size() - suffix.size()));
             }
-            if( pass_fail_code != ""){
-                pass_fail_code = "FAIL" + pass_fail_code;
+        }
+        closedir(dir);
+        std::sort(jobs.begin(), jobs.end());
+        return jobs;
+    }
+
+    // Runs annotation jobs from job_dir against the resident reference until job_dir/stop exists.
+    // A job is a batch manifest that clients write under another name and rename to <name>.job.
+    // The server claims it by renaming it to <name>.running and leaves it as <name>.done or <name>.failed,
+    // whatever the job throws. While serving, job_dir/server_<pid>.pid tells clients the server is alive.
+    int serve_jobs(const annotation_reference &ref, const string &job_dir, const calls_settings &settings,
+            size_t threads, size_t batch_jobs){
+        if(access(job_dir.c_str(), F_OK) != 0){
+            std::cerr << "[ERROR] Cannot open file: " << job_dir << std::endl;
+            return 1;
+        }
+        string pid_path = job_dir + "/server_" + std::to_string(getpid()) + ".pid";
+        std::ofstream(pid_path) << getpid() << "\n";
+        std::cerr << "Serving annotation jobs from " << job_dir << std::endl;
+        while(access((job_dir + "/stop").c_str(), F_OK) != 0){
+            vector<string> jobs = pending_jobs(job_dir);
+            if(jobs.empty()){
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                continue;
             }
-            else{
-                if( is_cluster_rt( cand.second, fin_score, forward_rt_ex, backward_rt_ex, 
-                            opt["maxrtdistance"].as<long>(), opt["maxrtfin"].as<double>())){
-                    pass_fail_code = "PASS:RT";
+            for(const string &job : jobs){
+                string job_path = job_dir + "/" + job;
+                if(std::rename((job_path + ".job").c_str(), (job_path + ".running").c_str()) != 0){
+                    continue; // claimed by another server on the same directory
                 }
-                else if( null_rejected){
-                    pass_fail_code = "PASS:GF";
+                bool ok = false;
+                try{
+                    vector<batch_sample> samples;
+                    ok = read_batch_manifest(job_path + ".running", samples) &&
+                        annotate_batch(ref, samples, settings, threads, batch_jobs) == 0;
                 }
-                else{
-                    pass_fail_code = "FAIL:RP";
+                catch(const std::exception &e){
+                    std::cerr << "[ERROR] Job " << job << ": " << e.what() << std::endl;
                 }
+                std::rename((job_path + ".running").c_str(), (job_path + (ok ? ".done" : ".failed")).c_str());
+                std::cerr << "Job " << job << (ok ? " done" : " failed") << std::endl;
             }
-            
-            //#FusionID(Ensembl) Forward-Support Backward-Support Multi-First-Exon No-First-Exon Genes-Overlap Segmental-Duplication-Count FusionName(Symbol) FiN-Score Pass-Fail-Status total-normal-count fusion-count normal-counts proper-normal-count proper-FiN-Score total-other-fusion-count other-fusion-counts ffigf-score proper-ffigf-score A B Anorm Bnorm 
-            std::cout << cand.first << "\t" << cand.second.forward.size() << "\t"
-                << cand.second.backward.size()  << "\t"
-                << cand.second.multi_first.size() << "\t" << cand.second.no_first.size()
-                << "\t" <<  cand.second.gene_overlaps.size() 
-                << "\t" <<  cand.second.duplications.size()
-                << "\t" << cand.second.name << "\t" << fin_score
-                << "\t" <<  pass_fail_code
-                << "\t" << gene_count_sum << "\t" << total_count <<  "\t"  << gene_count_string << "\t"
-                << total_count_putative_full_length << "\t" << genes.size() * total_count_putative_full_length / ( gene_count_sum + 1)
-                << "\t" <<  total_idf << "\t" << idf_string << "\t" << tfidf_score << "\t" << tfidf_score_full_len
-                << "\t" << fg_count  << "\t" << lg_count << "\t"
-                << forward_rt_ex << "\t" << backward_rt_ex << "\t"
-                << pvalue << "\t" << corr_pvalue << "\t" << (null_rejected?"pPASS":"pFAIL") 
-                << "\t" << static_cast<double>(cand.second.invalid)/cand.second.total_count() << "\n";
+        }
+        std::remove(pid_path.c_str());
+        return 0;
+    }
+
+    int run_annotate_calls(int argc, char **argv){
+        auto  opt = parse_args(argc, argv);
 
+        if(opt.count("merge-shards")){
+            return merge_shard_pvalues(opt["merge-shards"].as<vector<string>>(), opt["output"].as<string>() + "/shard_correction.tsv") ? 0 : 1;
         }
-       
-        string bp_file_path = opt["output"].as<string>() + "/breakpoints.tsv";
 
-        std::ofstream bp_file(bp_file_path);
+        string reference_path(opt["reference"].as<string>());
+        string gtf_path = reference_path + "/1.gtf";
+        string duplication_path = opt["duplications"].as<string>();
+        string cache_path = opt.count("annotation-cache") ? opt["annotation-cache"].as<string>() : "";
+        size_t threads = opt["threads"].as<size_t>();
+
+        if(opt["build-annotation-cache"].as<bool>()){
+            annotation_reference ref;
+            ref.gtf = gtf_index(gtf_path, false, threads);
+            ref.duplications = read_duplication_annotation(duplication_path, threads);
+            return write_annotation_cache(cache_path, gtf_path, duplication_path, ref) ? 0 : 1;
+        }
 
+        calls_settings settings{opt["minsupport"].as<size_t>(), !opt["c"].as<bool>(),
+            opt["maxrtdistance"].as<long>(), opt["maxrtfin"].as<double>(), opt["profile"].as<bool>(),
+            opt["low-memory"].as<bool>(), opt.count("spill-dir") ? opt["spill-dir"].as<string>() : "",
+            opt["breakpoint-clusters"].as<bool>(), opt["breakpoint-window"].as<int>(), opt["prune-low-support"].as<bool>()};
 
-        for( const auto &cand : fm.fusions){
-            string fusion_id = cand.first;
-            std::map<string, vector<locus>> breakpoints;
+        if(opt.count("serve")){
+            annotation_reference ref;
+            load_reference(ref, gtf_path, duplication_path, cache_path, threads);
+            return serve_jobs(ref, opt["serve"].as<string>(), settings, threads, opt["batch-jobs"].as<size_t>());
+        }
 
-            bool is_forward = true;
-            for(const auto &ff : {cand.second.forward, cand.second.backward}){//, cand.second.no_first, cand.second.multi_first}){
-                for(const auto &fus : ff){
-                    for(const auto &bp_pair : fus.get_breakpoints(is_forward)){
+        if(opt.count("batch")){
+            vector<batch_sample> samples;
+            if(!read_batch_manifest(opt["batch"].as<string>(), samples)){
+                exit(-1);
+            }
+            annotation_reference ref;
+            load_reference(ref, gtf_path, duplication_path, cache_path, threads);
+            return annotate_batch(ref, samples, settings, threads, opt["batch-jobs"].as<size_t>());
+        }
 
-                        bp_file << fus.read_id <<"\t" << fusion_id << "\t" << bp_pair.first << "\t" << bp_pair.second << "\n";
-                        breakpoints[bp_pair.first].push_back(bp_pair.second);
-                    }
-                }
-                is_forward = false;
+        fusion_shard shard{0, 1, NULL};
+        if(opt.count("shard") && !fusion_shard::parse(opt["shard"].as<string>(), shard)){
+            std::cerr << "[ERROR] --shard takes K/N with K < N: " << opt["shard"].as<string>() << std::endl;
+            exit(-1);
+        }
+        shard_correction correction;
+        if(opt.count("shard") && !opt.count("shard-correction")){
+            annotation_reference ref;
+            load_reference(ref, gtf_path, duplication_path, cache_path, threads, false);
+            string pvalue_path = opt["output"].as<string>() + "/shard_" + std::to_string(shard.index) + ".pvalues";
+            return test_shard(ref, opt["input"].as<string>(), pvalue_path, settings, threads, shard) ? 0 : 1;
+        }
+        if(opt.count("shard")){
+            if(!correction.read(opt["shard-correction"].as<string>())){
+                exit(-1);
             }
+            shard.correction = &correction;
         }
-        bp_file.close();
-        return 0;  
+
+        bool footprint_duplications = opt["segdup-footprint"].as<bool>() && cache_path == "";
+        stage_profiler profiler(settings.profile);
+        annotation_reference ref;
+        load_reference(ref, gtf_path, duplication_path, cache_path, threads, !footprint_duplications, &profiler);
+        if(!annotate_sample(ref, opt["input"].as<string>(), opt["output"].as<string>(), settings, threads,
+                std::cerr, std::cout, profiler, footprint_duplications ? duplication_path : "",
+                opt.count("shard") ? &shard : NULL)){
+            exit(-1);
+        }
+        return 0;
     }
+
+    int annotate_calls(int argc, char **argv){
+        return exit_on_annotate_error([&] { return run_annotate_calls(argc, argv); });
+    }
+
        
 } 
@@ -18,6 +18,7 @@ Authors: Harry Kane, PhD; Eren Ada, PhD
 Based on AI_GENION_CUSTOMIZATION_GUIDE.md and detailed analysis
 """
 import os
+import re
 import sys
 import subprocess
 import shutil
@@ -117,6 +118,7 @@ def apply_typhon_modifications(temp_dir, custom_annotate_path, patch_path, log_p
     1. Backup original annotate.cpp
     2. Replace with TYPHON version (includes read ID tracking)
     3. Apply additional cleanup patch
+    4. Link zlib and pthreads, which the TYPHON annotate.cpp uses
     """
     src_dir = os.path.join(temp_dir, "src")
     original_annotate = os.path.join(src_dir, "annotate.cpp")
@@ -152,6 +154,41 @@ def apply_typhon_modifications(temp_dir, custom_annotate_path, patch_path, log_p
         log_to_file(f"WARNING: Patch application failed (may be already applied): {e}", log_path)
         # Continue - the main customization (file replacement) is already done
 
+    # Step 4: Link flags of the custom annotate.cpp
+    add_annotate_link_flags(temp_dir, log_path)
+
+
+# Libraries the TYPHON annotate.cpp needs beyond Genion's own: zlib for gzip/bgzip inputs and
+# pthreads for its worker threads
+ANNOTATE_LINK_FLAGS = ['-lz', '-pthread']
+
+
+def add_annotate_link_flags(temp_dir, log_path):
+    """
+    Add ANNOTATE_LINK_FLAGS to Genion's Makefile.
+
+    The flags missing from the first LDFLAGS, LDLIBS or LIBS assignment are appended to it; a
+    Makefile without one gets an 'LDFLAGS +=' line, which its link rule must use.
+    """
+    makefile = os.path.join(temp_dir, "Makefile")
+    with open(makefile) as f:
+        lines = f.read().split('\n')
+    assignment = re.compile(r'^\s*(LDFLAGS|LDLIBS|LIBS)\s*[:+?]?=')
+    for i, line in enumerate(lines):
+        match = assignment.match(line)
+        if match:
+            missing = [flag for flag in ANNOTATE_LINK_FLAGS if flag not in line[match.end():].split()]
+            if missing:
+                lines[i] = line.rstrip() + ' ' + ' '.join(missing)
+            log_to_file(f"Link flags for annotate.cpp: {lines[i].strip()}", log_path)
+            break
+    else:
+        lines.append('LDFLAGS += ' + ' '.join(ANNOTATE_LINK_FLAGS))
+        log_to_file("WARNING: No LDFLAGS/LDLIBS/LIBS in Genion's Makefile, appended "
+                    f"'LDFLAGS += {' '.join(ANNOTATE_LINK_FLAGS)}'", log_path)
+    with open(makefile, 'w') as f:
+        f.write('\n'.join(lines))
+
 
 def cleanup_files(patch_path, custom_annotate_path, log_path):
     """Remove customization files if requested."""
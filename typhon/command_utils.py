@@ -54,7 +54,7 @@ def setup_module_logger(module_name, output_dir):
     return logger
 
 
-def run_command(cmd, shell=True, check=True, capture_output=False, cwd=None, log_output=True):
+def run_command(cmd, shell=True, check=True, capture_output=False, cwd=None, log_output=True, env=None):
     """
     Run a shell command with enhanced logging and error checking.
     
@@ -65,6 +65,7 @@ def run_command(cmd, shell=True, check=True, capture_output=False, cwd=None, log
         capture_output: Whether to capture output for return
         cwd: Working directory
         log_output: Whether to log command output (default: True)
+        env: Environment for the command (default: inherit the current one)
     
     Returns:
         subprocess.CompletedProcess or stdout string if capture_output=True
@@ -93,7 +94,8 @@ def run_command(cmd, shell=True, check=True, capture_output=False, cwd=None, log
             check=check, 
             capture_output=True,  # Always capture for logging
             text=True, 
-            cwd=cwd
+            cwd=cwd,
+            env=env
         )
         
         # Calculate execution time
@@ -21,6 +21,8 @@ except ImportError as e:
     print("Install with: pip install pandas numpy")
     exit(1)
 
+from typhon.utils.genion_columns import read_genion_columns
+
 
 class DataIntegrator:
     """Handles Phase 1: Data Integration and Preparation for exon repair."""
@@ -270,6 +272,9 @@ class DataIntegrator:
         
         Standardizes Chimera_ID format by converting :: to : for consistency with other tools.
         This ensures Genion results are properly integrated instead of being filtered out.
+        Normalized runs (a .tsv.reads table next to the .tsv) are joined on the fusion id.
+        Columnar runs (a .tsv.cols table next to the .tsv) are read from its typed columns.
+        Low support fusions pruned by the annotator are read from the .tsv.pruned side files.
         """
         # R equivalent: Genion <- read.xlsx("file.xlsx")
         # Genion_subset <- Genion[, c(28, 8)]
@@ -281,9 +286,28 @@ class DataIntegrator:
         # Find .tsv files (passed Genion results) and .fail files
         tsv_files = list(Path(genion_dir).glob('*_genion.tsv'))
         fail_files = list(Path(genion_dir).glob('*_genion.tsv.fail'))
+        pruned_files = list(Path(genion_dir).glob('*_genion.tsv.pruned'))
         
         # Process TSV files
         for tsv_file in tsv_files:
+            column_table = tsv_file.with_name(tsv_file.name + '.cols')
+            if column_table.exists():
+                # The .tsv of a columnar run has no read ids to fall back to
+                try:
+                    genion_chimeras.extend(self._load_genion_column_table(column_table))
+                except Exception as e:
+                    self.logger.error(f"Could not read Genion columnar table {column_table}: {e}")
+                    raise
+                files_found.append(str(tsv_file))
+                continue
+            read_table = tsv_file.with_name(tsv_file.name + '.reads')
+            if read_table.exists():
+                try:
+                    genion_chimeras.extend(self._load_genion_read_table(tsv_file, read_table))
+                    files_found.append(str(tsv_file))
+                except Exception as e:
+                    self.logger.warning(f"Could not read {tsv_file} with {read_table}: {e}")
+                continue
             try:
                 df = pd.read_csv(tsv_file, sep='\t', header=None)
                 if len(df.columns) >= 28:
@@ -322,6 +346,14 @@ class DataIntegrator:
             except Exception as e:
                 self.logger.warning(f"Could not read {fail_file}: {e}")
         
+        # Process .pruned files (FAIL:lowsup fusions with their read ids, see run_genion prune_low_support)
+        for pruned_file in pruned_files:
+            try:
+                genion_chimeras.extend(self._load_genion_pruned(pruned_file))
+                files_found.append(str(pruned_file))
+            except Exception as e:
+                self.logger.warning(f"Could not read {pruned_file}: {e}")
+        
         if not genion_chimeras:
             self.logger.warning("No Genion results found")
             return pd.DataFrame(columns=['Read_ID', 'Chimera_ID'])
@@ -331,6 +363,49 @@ class DataIntegrator:
         return genion_df
     
     
+    def _load_genion_read_table(self, summary_file: Path, read_table: Path) -> List[Dict[str, str]]:
+        """
+        Read IDs of a normalized Genion run: one summary row per fusion (fusion id in column 1,
+        Chimera_ID in column 8) and a two column fusion_id/read_id table.
+        """
+        summary = pd.read_csv(summary_file, sep='\t', header=None, usecols=[0, 7], dtype=str)
+        chimera_ids = dict(zip(summary[0], summary[7]))
+        reads = pd.read_csv(read_table, sep='\t', header=None, names=['fusion_id', 'read_id'], dtype=str)
+        
+        chimeras = []
+        for fusion_id, read_id in zip(reads['fusion_id'], reads['read_id']):
+            chimera_id = chimera_ids.get(fusion_id)
+            if chimera_id is None or pd.isna(read_id):
+                continue
+            chimeras.append({'Read_ID': str(read_id), 'Chimera_ID': str(chimera_id).replace('::', ':')})
+        return chimeras
+    
+    
+    def _load_genion_pruned(self, pruned_file: Path) -> List[Dict[str, str]]:
+        """
+        Read IDs of the pruned low support fusions: fusion name (Chimera_ID) in column 2 and the
+        comma separated read ids in column 10.
+        """
+        chimeras = []
+        with open(pruned_file) as f:
+            for line in f:
+                fields = line.rstrip('\n').split('\t')
+                if len(fields) < 10:
+                    continue
+                chimera_id = fields[1].replace('::', ':')
+                for read_id in fields[9].split(','):
+                    if read_id:
+                        chimeras.append({'Read_ID': read_id, 'Chimera_ID': chimera_id})
+        return chimeras
+    
+    
+    def _load_genion_column_table(self, column_table: Path) -> List[Dict[str, str]]:
+        """Read IDs of a columnar Genion run, from the read_id and fusion_name (Chimera_ID) columns."""
+        columns = read_genion_columns(column_table, columns={'fusion_name', 'read_id'})
+        return [{'Read_ID': str(read_id), 'Chimera_ID': str(chimera_id).replace('::', ':')}
+                for read_id, chimera_id in zip(columns['read_id'], columns['fusion_name'])]
+    
+    
     def _load_jaffal_results(self, jaffal_file: str) -> pd.DataFrame:
         """Load JaffaL results from combined results file."""
         # R equivalent: JaffaL <- read.xlsx("file.xlsx")
@@ -1,5 +1,6 @@
 import os
 import shutil
+import time
 from datetime import datetime
 import gzip
 import tempfile
@@ -47,6 +48,68 @@ def get_genion_bin():
     return bin_path
 
 
+def _annotation_server_running(job_dir):
+    """True if a server on this host is serving job_dir, from the server_<pid>.pid files it keeps there."""
+    for name in os.listdir(job_dir):
+        if not (name.startswith('server_') and name.endswith('.pid')):
+            continue
+        try:
+            os.kill(int(name[len('server_'):-len('.pid')]), 0)
+            return True
+        except ValueError:
+            continue
+        except ProcessLookupError:
+            continue  # left behind by a server that died
+        except PermissionError:
+            return True  # alive, owned by another user
+    return False
+
+
+def submit_annotation_job(job_dir, samples, job_name=None, timeout=6 * 3600, poll_interval=1.0):
+    """
+    Submit samples to a running 'annotate calls --serve <job_dir>' Genion server and wait for them.
+
+    Args:
+        job_dir: Job directory the server watches; the server must run on this host
+        samples: List of (input_dir, output_dir) pairs; input_dir holds chains.fixed.txt and feature_table.tsv
+        job_name: Job name, defaults to a timestamp and process id
+        timeout: Seconds to wait before giving up (default: 6 hours, None waits indefinitely)
+        poll_interval: Seconds between checks for the job result
+
+    Returns:
+        True if the server annotated every sample, False if the job failed.
+        Each sample's output_dir then holds calls.tsv, calls.log and breakpoints.tsv.
+
+    Raises:
+        RuntimeError: No server is serving job_dir, or it stopped before finishing the job
+        TimeoutError: The job did not finish within timeout seconds
+    """
+    if not _annotation_server_running(job_dir):
+        raise RuntimeError(f"No Genion annotation server is serving {job_dir}")
+    if job_name is None:
+        job_name = f"{datetime.now().strftime('%Y%m%d%H%M%S%f')}_{os.getpid()}"
+    job_path = os.path.join(job_dir, job_name)
+    # Write under another name and rename, so the server never reads a partial manifest
+    with open(job_path + '.tmp', 'w') as f:
+        for input_dir, output_dir in samples:
+            f.write(f"{os.path.abspath(input_dir)}\t{os.path.abspath(output_dir)}\n")
+    os.rename(job_path + '.tmp', job_path + '.job')
+
+    start = time.time()
+    while True:
+        # Checked before the results, so a server that finishes the job and then stops is not an error
+        server_running = _annotation_server_running(job_dir)
+        if os.path.exists(job_path + '.done'):
+            return True
+        if os.path.exists(job_path + '.failed'):
+            return False
+        if not server_running:
+            raise RuntimeError(f"Genion annotation server for {job_dir} stopped before finishing job {job_name}")
+        if timeout is not None and time.time() - start > timeout:
+            raise TimeoutError(f"Genion annotation job {job_name} did not finish within {timeout} seconds")
+        time.sleep(poll_interval)
+
+
 def run_genion(
     input_fastq,
     input_sam,
@@ -59,7 +122,15 @@ def run_genion(
     genomic_superdups=None,
     keep_intermediate=False,
     log_path=None,
-    min_support=1
+    min_support=1,
+    annotation_cache=None,
+    normalized_output=False,
+    columnar_output=False,
+    segdup_footprint=False,
+    profile=False,
+    low_memory=False,
+    spill_dir=None,
+    prune_low_support=False
 ):
     """
     Run the Genion pipeline step for Typhon, for a single sample.
@@ -74,12 +145,33 @@ def run_genion(
         selfalign_paf: Path to self-alignment PAF file
         selfalign_tsv: Path to self-alignment TSV file
         output_dir: Output directory for results
-        threads: Number of threads (not used by Genion itself)
+        threads: Number of threads for Genion's fusion scoring and output
         genion_bin: Path to custom Genion binary
-        genomic_superdups: Path to genomic segmental duplications file
+        genomic_superdups: Path to genomic segmental duplications file (plain, gzip or bgzip)
         keep_intermediate: Whether to keep intermediate files
         log_path: Path to log file
         min_support: Minimum supporting reads for fusion calls (default: 1)
+        annotation_cache: Path of a binary annotation cache reused by all samples.
+            Built on the first run; later runs read it into memory instead of parsing the GTF
+            and duplication text, while those files are unchanged.
+        normalized_output: Write one row per fusion to the .tsv and the supporting reads to
+            <sample>_genion.tsv.reads (fusion_id, read_id) instead of one row per read.
+        columnar_output: Write one row per fusion to the .tsv and a typed columnar table of the
+            supporting reads and their fusions' scores to <sample>_genion.tsv.cols
+            (see typhon.utils.genion_columns). Takes precedence over normalized_output.
+        segdup_footprint: Load only the segmental duplications overlapping the candidate
+            fusions' genes. Ignored when annotation_cache is set.
+        profile: Write per stage wall/CPU times and item counts of the annotate stage to
+            <sample>_genion.tsv.profile.json.
+        low_memory: Keep compact per gene read summaries instead of alignment blocks while
+            scoring. Output is unchanged, peak memory is lower.
+        spill_dir: Directory for temporary files holding the read summaries while scoring,
+            for samples whose reads do not fit in memory. Implies low_memory, output is unchanged.
+        prune_low_support: Write fusions with fewer than min_support supporting reads, which always
+            fail as lowsup, to <sample>_genion.tsv.pruned (id, name, read counts, p-values, read
+            ids) instead of annotating and scoring them. Their reads are left out of the .tsv and
+            .fail files and exon repair reads them from the .pruned file; the multiple testing
+            correction of the other fusions is unchanged.
     """
     # Set up logging
     if log_path is None:
@@ -103,7 +195,8 @@ def run_genion(
         sam_for_use = decompress_if_gzipped(input_sam, log)
         if sam_for_use != input_sam:
             temp_files.append(sam_for_use)
-        # Decompress GTF and self-align reference files if needed
+        # Decompress GTF and self-align reference files if needed. The annotate stage reads
+        # gzip/bgzip itself, but Genion's candidate stage still needs a plain GTF.
         gtf_for_use = decompress_if_gzipped(gtf_for_genion, log)
         if gtf_for_use != gtf_for_genion:
             temp_files.append(gtf_for_use)
@@ -137,8 +230,29 @@ def run_genion(
             '-o', genion_out,
             '--min-support', str(min_support)
         ]
+        genion_env = os.environ.copy()
+        genion_env['GENION_THREADS'] = str(threads)
+        if annotation_cache:
+            genion_env['GENION_ANNOTATION_CACHE'] = str(annotation_cache)
+            log(f'Using annotation cache: {annotation_cache}')
+        if normalized_output:
+            genion_env['GENION_NORMALIZED_OUTPUT'] = '1'
+        if columnar_output:
+            genion_env['GENION_COLUMNAR_OUTPUT'] = '1'
+        if segdup_footprint:
+            genion_env['GENION_SEGDUP_FOOTPRINT'] = '1'
+        if profile:
+            genion_env['GENION_PROFILE'] = '1'
+        if low_memory:
+            genion_env['GENION_LOW_MEMORY'] = '1'
+        if spill_dir:
+            os.makedirs(spill_dir, exist_ok=True)
+            genion_env['GENION_SPILL_DIR'] = str(spill_dir)
+            log(f'Spilling read summaries to: {spill_dir}')
+        if prune_low_support:
+            genion_env['GENION_PRUNE_LOW_SUPPORT'] = '1'
         log(f"Running Genion: {' '.join(str(x) for x in genion_cmd)}")
-        run_command(genion_cmd, shell=False)
+        run_command(genion_cmd, shell=False, env=genion_env)
         log(f'Genion output: {genion_out}')
 
         # 3. Cleanup intermediate files if requested
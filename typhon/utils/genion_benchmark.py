@@ -0,0 +1,464 @@
+#!/usr/bin/env python3
+"""
+Genion Annotate Benchmark
+
+Generates synthetic inputs for Genion's annotate stage (chains.fixed.txt, feature_table.tsv,
+a Genion style GTF and a genomicSuperDups table) and times 'annotate calls' on them.
+Stage timings come from the annotator's --profile report, so each run benchmarks the GTF and
+segdup loaders, chain parsing with fusion_manager::add_read, duplication/overlap annotation,
+hypothesis testing and output separately, plus the whole run.
+
+Typical nightly use, with a fixed seed so runs are comparable:
+    python -m typhon.utils.genion_benchmark run --annotate-cmd "<genion annotate calls command>" \\
+        --workload bench/default --output bench/today.json --baseline bench/baseline.json
+
+shard-check runs the sharded annotation on its own workload and fails unless the shards' outputs,
+concatenated in order, are the single run's:
+    python -m typhon.utils.genion_benchmark shard-check --annotate-cmd "<...>" --workload bench/shards
+"""
+
+import os
+import sys
+import json
+import math
+import random
+import shlex
+import shutil
+import hashlib
+import argparse
+import statistics
+import subprocess
+
+
+WORKLOAD_DEFAULTS = {
+    'seed': 1,
+    'genes': 2000,
+    'chromosomes': 22,
+    'reads': 100000,
+    'normal_reads': 500000,
+    'segdups': 20000,
+    'cluster_size_distribution': 'geometric',
+    'mean_cluster_size': 5.0,
+    'multi_gene_rate': 0.05,
+    'neighbour_rate': 0.2,
+    'noise_rate': 0.05,
+}
+
+# shard-check workload: a few clusters larger than the annotator's 16 MB parse chunks, so some shards
+# parse whole chunks without any of their own fusions but with gene counts that their scores need
+SHARD_CHECK_WORKLOAD = {
+    'genes': 3,
+    'reads': 300000,
+    'normal_reads': 20000,
+    'segdups': 100,
+    'cluster_size_distribution': 'fixed',
+    'mean_cluster_size': 100000,
+    'multi_gene_rate': 0.0,
+}
+
+
+def _cluster_size(rng, distribution, mean):
+    """Draw one fusion cluster size (reads sharing a gene pair) with the given mean."""
+    if distribution == 'fixed':
+        return max(1, int(round(mean)))
+    if distribution == 'geometric':
+        if mean <= 1:
+            return 1
+        p = 1.0 / mean
+        return 1 + int(math.log(1.0 - rng.random()) / math.log(1.0 - p))
+    if distribution == 'zipf':
+        # Pareto tail with the requested mean, the heavy tailed case of a few very large clusters
+        alpha = mean / (mean - 1.0) if mean > 1 else 50.0
+        return max(1, int(rng.paretovariate(alpha)))
+    raise ValueError("cluster_size_distribution must be 'fixed', 'geometric' or 'zipf'")
+
+
+def generate_workload(out_dir, **params):
+    """
+    Write a synthetic annotate workload to out_dir.
+
+    Args:
+        out_dir: Output directory; gets ref/1.gtf, genomicSuperDups.txt, in/chains.fixed.txt,
+            in/feature_table.tsv and workload.json with the parameters used
+        **params: Overrides of WORKLOAD_DEFAULTS (seed, genes, chromosomes, reads, normal_reads,
+            segdups, cluster_size_distribution, mean_cluster_size, multi_gene_rate,
+            neighbour_rate, noise_rate)
+
+    Returns:
+        dict: The workload parameters
+    """
+    unknown = set(params) - set(WORKLOAD_DEFAULTS)
+    if unknown:
+        raise ValueError(f"Unknown workload parameters: {', '.join(sorted(unknown))}")
+    config = dict(WORKLOAD_DEFAULTS, **params)
+    rng = random.Random(config['seed'])
+    gene_total = config['genes']
+    chromosomes = config['chromosomes']
+
+    os.makedirs(os.path.join(out_dir, 'ref'), exist_ok=True)
+    os.makedirs(os.path.join(out_dir, 'in'), exist_ok=True)
+
+    # Genes spaced along each chromosome, 1-3 transcripts of 1-12 exons
+    genes = []
+    with open(os.path.join(out_dir, 'ref', '1.gtf'), 'w') as f:
+        f.write("##description: TYPHON synthetic benchmark annotation\n")
+        for g in range(gene_total):
+            chrom = str(1 + g % chromosomes)
+            start = 10000 + (g // chromosomes) * 60000 + rng.randint(0, 30000)
+            end = start + rng.randint(5000, 50000)
+            strand = rng.choice("+-")
+            gene_id = "ENSG%011d" % g
+            gene_type = "protein_coding" if rng.random() < 0.8 else "lncRNA"
+            f.write(f'{chrom}\tHAVANA\tgene\t{start}\t{end}\t.\t{strand}\t.\tgene_id "{gene_id}.1"; '
+                    f'gene_type "{gene_type}"; gene_name "GN{g}"; level 2;\n')
+            transcripts = []
+            for t in range(rng.randint(1, 3)):
+                transcript_id = "ENST%011d" % (g * 10 + t)
+                attrs = f'gene_id "{gene_id}.1"; transcript_id "{transcript_id}.1"; gene_type "{gene_type}"; gene_name "GN{g}";'
+                f.write(f'{chrom}\tHAVANA\ttranscript\t{start}\t{end}\t.\t{strand}\t.\t{attrs}\n')
+                exon_count = rng.randint(1, 12)
+                exons = []
+                step = (end - start) // exon_count
+                for e in range(exon_count):
+                    exon_start = start + e * step
+                    exon_end = exon_start + rng.randint(50, min(300, max(50, step - 1)))
+                    exons.append((exon_start, exon_end))
+                    f.write(f'{chrom}\tHAVANA\texon\t{exon_start}\t{exon_end}\t.\t{strand}\t.\t{attrs} '
+                            f'exon_number "{e + 1}"; exon_id "ENSE{g * 100 + t * 10 + e:011d}";\n')
+                transcripts.append((transcript_id, exons))
+            genes.append((gene_id, chrom, start, end, strand, transcripts))
+
+    # genomicSuperDups.txt columns used by Genion: 1-3 (copy), 7-9 (other copy), 26 (fracMatch)
+    with open(os.path.join(out_dir, 'genomicSuperDups.txt'), 'w') as f:
+        for i in range(config['segdups']):
+            g1 = rng.choice(genes)
+            g2 = rng.choice(genes)
+            s = max(0, rng.randint(g1[2] - 2000, g1[3]))
+            ms = max(0, rng.randint(g2[2] - 2000, g2[3]))
+            row = [str(585 + i % 1000), "chr" + g1[1], str(s), str(s + rng.randint(1000, 20000)),
+                   f"chr{g2[1]}:{ms}", "0", "+", "chr" + g2[1], str(ms), str(ms + rng.randint(1000, 20000))]
+            row += ["0"] * 16 + ["%.6f" % rng.uniform(0.9, 1.0)] + ["0"] * 3
+            f.write("\t".join(row) + "\n")
+
+    def block(g, reverse):
+        gene_id, chrom, _, _, strand, transcripts = genes[g]
+        transcript_id, exons = rng.choice(transcripts)
+        k = rng.randrange(len(exons))
+        exon_start, exon_end = exons[k]
+        return [str(rng.randint(0, 500)), str(exon_start + rng.randint(-20, 20)), str(exon_end + rng.randint(-20, 20)),
+                chrom, "0", "0", "1" if reverse else "0", "0", str(exon_start), str(exon_end),
+                "1" if strand == "-" else "0", gene_id, transcript_id, str(k + 1)]
+
+    # Reads in clusters of one gene pair; some carry a third gene or inconsistent strands
+    with open(os.path.join(out_dir, 'in', 'chains.fixed.txt'), 'w') as f:
+        read_index = 0
+        while read_index < config['reads']:
+            a, b = rng.sample(range(gene_total), 2)
+            if rng.random() < config['neighbour_rate']:
+                b = (a + chromosomes) % gene_total  # next gene on the same chromosome
+            size = min(_cluster_size(rng, config['cluster_size_distribution'], config['mean_cluster_size']),
+                       config['reads'] - read_index)
+            for _ in range(size):
+                read_genes = [a, b] if rng.random() < 0.9 else [b, a]
+                if rng.random() < config['multi_gene_rate']:
+                    read_genes.append(rng.randrange(gene_total))
+                orientation = rng.random() < 0.5
+                noisy = rng.random() < config['noise_rate']
+                blocks = []
+                for g in read_genes:
+                    reverse = (genes[g][4] == "-") != orientation
+                    if noisy:
+                        reverse = rng.random() < 0.5
+                    for _ in range(rng.randint(1, 3)):
+                        blocks.append(block(g, reverse))
+                f.write("read%09d\t%d\n" % (read_index, len(blocks)))
+                for b_fields in blocks:
+                    f.write("\t".join(b_fields) + "\n")
+                read_index += 1
+
+    # Mostly non chimeric alignments, which give the per gene normal counts
+    with open(os.path.join(out_dir, 'in', 'feature_table.tsv'), 'w') as f:
+        for r in range(config['normal_reads']):
+            g = rng.randrange(gene_total)
+            h = g if rng.random() < 0.95 else rng.randrange(gene_total)
+            split = 0 if rng.random() < 0.9 else 1
+            f.write("nread%09d\tENSG%011d::ENSG%011d\t%d\n" % (r, g, h, split))
+
+    with open(os.path.join(out_dir, 'workload.json'), 'w') as f:
+        json.dump(config, f, indent=2, sort_keys=True)
+    return config
+
+
+# Run files left out of the output digest by default: timings, and stderr, whose warnings come
+# from parallel parsing in no fixed order
+UNHASHED_OUTPUTS = {'profile.json', 'calls.log'}
+
+
+def _sha256_file(path):
+    digest = hashlib.sha256()
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(1 << 20), b''):
+            digest.update(chunk)
+    return digest.hexdigest()
+
+
+def _output_digests(out_dir, output_files=None):
+    """SHA-256 of each named output file of a run, by default every file in out_dir but UNHASHED_OUTPUTS."""
+    if output_files is None:
+        output_files = sorted(name for name in os.listdir(out_dir)
+                              if name not in UNHASHED_OUTPUTS and os.path.isfile(os.path.join(out_dir, name)))
+    return {name: _sha256_file(os.path.join(out_dir, name)) for name in output_files}
+
+
+def _combined_digest(digests):
+    digest = hashlib.sha256()
+    for name in sorted(digests):
+        digest.update(f"{name}\t{digests[name]}\n".encode())
+    return digest.hexdigest()
+
+
+def run_benchmark(annotate_cmd, workload_dir, threads=1, repeats=3, extra_args=None, output_files=None):
+    """
+    Time 'annotate calls' on a generated workload.
+
+    Args:
+        annotate_cmd: Command that runs Genion's annotate_calls entry point (string or list)
+        workload_dir: Directory written by generate_workload
+        threads: Value of the annotator's --threads
+        repeats: Number of runs; medians are reported
+        extra_args: Additional annotate arguments, e.g. ['--segdup-footprint']
+        output_files: Names of the run's output files to hash; by default every file the run
+            writes (calls.tsv, breakpoints.tsv and whatever extra_args add, such as
+            breakpoint_clusters.tsv or pruned.tsv) except profile.json and calls.log
+
+    Returns:
+        dict: Median wall and CPU seconds overall and per stage, stage counts, peak RSS and
+            the SHA-256 of each output and of all of them, which must be the same for every repeat
+    """
+    if isinstance(annotate_cmd, str):
+        annotate_cmd = shlex.split(annotate_cmd)
+    with open(os.path.join(workload_dir, 'workload.json')) as f:
+        workload = json.load(f)
+
+    runs = []
+    digests = []
+    for repeat in range(repeats):
+        out_dir = os.path.join(workload_dir, 'runs', str(repeat))
+        if os.path.isdir(out_dir):
+            shutil.rmtree(out_dir)  # so outputs of earlier runs with other arguments are not hashed
+        os.makedirs(out_dir)
+        cmd = annotate_cmd + [
+            '-i', os.path.join(workload_dir, 'in'),
+            '-o', out_dir,
+            '-d', os.path.join(workload_dir, 'genomicSuperDups.txt'),
+            '-r', os.path.join(workload_dir, 'ref'),
+            '-t', str(threads),
+            '--profile',
+        ] + list(extra_args or [])
+        with open(os.path.join(out_dir, 'calls.tsv'), 'w') as out, open(os.path.join(out_dir, 'calls.log'), 'w') as err:
+            subprocess.run(cmd, stdout=out, stderr=err, check=True)
+        with open(os.path.join(out_dir, 'profile.json')) as f:
+            runs.append(json.load(f))
+        digests.append(_output_digests(out_dir, output_files))
+    if any(d != digests[0] for d in digests):
+        raise RuntimeError("Annotate output differs between repeats of the same workload")
+
+    stages = {}
+    for stage in runs[0]['stages']:
+        name = stage['name']
+        stage_runs = [s for run in runs for s in run['stages'] if s['name'] == name]
+        stages[name] = {
+            'wall_seconds': statistics.median(s['wall_seconds'] for s in stage_runs),
+            'cpu_seconds': statistics.median(s['cpu_seconds'] for s in stage_runs),
+            'counts': stage['counts'],
+        }
+    return {
+        'workload': workload,
+        'threads': threads,
+        'repeats': repeats,
+        'extra_args': list(extra_args or []),
+        'wall_seconds': statistics.median(run['wall_seconds'] for run in runs),
+        'cpu_seconds': statistics.median(run['cpu_seconds'] for run in runs),
+        'peak_rss_kb': max(run['peak_rss_kb'] for run in runs),
+        'stages': stages,
+        'output_sha256': _combined_digest(digests[0]),
+        'output_files': digests[0],
+    }
+
+
+def _annotate(annotate_cmd, workload_dir, out_dir, args, threads=1):
+    """Run annotate calls on workload_dir into out_dir, stdout to calls.tsv and stderr to calls.log."""
+    os.makedirs(out_dir, exist_ok=True)
+    cmd = annotate_cmd + [
+        '-i', os.path.join(workload_dir, 'in'),
+        '-o', out_dir,
+        '-d', os.path.join(workload_dir, 'genomicSuperDups.txt'),
+        '-r', os.path.join(workload_dir, 'ref'),
+        '-t', str(threads),
+    ] + list(args)
+    with open(os.path.join(out_dir, 'calls.tsv'), 'w') as out, open(os.path.join(out_dir, 'calls.log'), 'w') as err:
+        subprocess.run(cmd, stdout=out, stderr=err, check=True)
+
+
+def check_shards(annotate_cmd, workload_dir, shards=3, threads=1):
+    """
+    Run a sharded annotation (test passes, --merge-shards, output passes) and a single run on a
+    workload and check that the shards' calls.tsv and breakpoints.tsv, concatenated in shard order,
+    are the single run's.
+
+    Returns:
+        list: Messages for the outputs that differ, empty if the sharded run matches
+    """
+    if isinstance(annotate_cmd, str):
+        annotate_cmd = shlex.split(annotate_cmd)
+    check_dir = os.path.join(workload_dir, 'runs', 'shard_check')
+    single_dir = os.path.join(check_dir, 'single')
+    _annotate(annotate_cmd, workload_dir, single_dir, [], threads)
+
+    shard_dir = os.path.join(check_dir, 'shards')
+    for k in range(shards):
+        _annotate(annotate_cmd, workload_dir, shard_dir, ['--shard', f'{k}/{shards}'], threads)
+    pvalue_paths = [os.path.join(shard_dir, f'shard_{k}.pvalues') for k in range(shards)]
+    subprocess.run(annotate_cmd + ['--merge-shards', ','.join(pvalue_paths), '-o', shard_dir], check=True)
+    correction = os.path.join(shard_dir, 'shard_correction.tsv')
+    for k in range(shards):
+        _annotate(annotate_cmd, workload_dir, os.path.join(shard_dir, str(k)),
+                  ['--shard', f'{k}/{shards}', '--shard-correction', correction], threads)
+
+    problems = []
+    for name in ('calls.tsv', 'breakpoints.tsv'):
+        merged = b''
+        for k in range(shards):
+            with open(os.path.join(shard_dir, str(k), name), 'rb') as f:
+                merged += f.read()
+        with open(os.path.join(single_dir, name), 'rb') as f:
+            if f.read() != merged:
+                problems.append(f"{name} of {shards} shards differs from the single run")
+    return problems
+
+
+def compare_results(result, baseline, tolerance=0.10, min_seconds=0.05):
+    """
+    List regressions of result against a baseline result of the same workload.
+
+    A time counts as a regression when it is more than tolerance (fraction) slower and more
+    than min_seconds slower, so noise on very short stages does not fail a nightly run.
+    Different outputs for the same workload and arguments are reported too.
+
+    Returns:
+        list: Human readable regression messages, empty if there are none
+    """
+    problems = []
+    if result['workload'] != baseline['workload'] or result['extra_args'] != baseline.get('extra_args', []):
+        return ["Baseline was measured on a different workload or with different arguments"]
+    if result['output_sha256'] != baseline['output_sha256']:
+        before = baseline.get('output_files')
+        if before is None:
+            problems.append("Annotate output changed for the same workload")
+        else:
+            now = result['output_files']
+            for name in sorted(set(now) | set(before)):
+                if now.get(name) != before.get(name):
+                    problems.append(f"Annotate output {name} changed for the same workload")
+
+    def check(name, now, before):
+        if now > before * (1.0 + tolerance) and now - before > min_seconds:
+            problems.append(f"{name}: {now:.3f}s vs {before:.3f}s baseline (+{100.0 * (now / before - 1.0):.1f}%)")
+
+    check('total', result['wall_seconds'], baseline['wall_seconds'])
+    for name, stage in result['stages'].items():
+        if name in baseline['stages']:
+            check(name, stage['wall_seconds'], baseline['stages'][name]['wall_seconds'])
+    limit = baseline['peak_rss_kb'] * (1.0 + tolerance)
+    if result['peak_rss_kb'] > limit:
+        problems.append(f"peak_rss_kb: {result['peak_rss_kb']} vs {baseline['peak_rss_kb']} baseline")
+    return problems
+
+
+def main():
+    """Main function for command line usage."""
+    parser = argparse.ArgumentParser(
+        description="Generate synthetic workloads for Genion's annotate stage and benchmark it"
+    )
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    def add_workload_arguments(p):
+        p.add_argument('--seed', type=int, default=WORKLOAD_DEFAULTS['seed'])
+        p.add_argument('--genes', type=int, default=WORKLOAD_DEFAULTS['genes'])
+        p.add_argument('--chromosomes', type=int, default=WORKLOAD_DEFAULTS['chromosomes'])
+        p.add_argument('--reads', type=int, default=WORKLOAD_DEFAULTS['reads'], help='Chimeric reads in chains.fixed.txt')
+        p.add_argument('--normal-reads', type=int, default=WORKLOAD_DEFAULTS['normal_reads'], help='Rows of feature_table.tsv')
+        p.add_argument('--segdups', type=int, default=WORKLOAD_DEFAULTS['segdups'])
+        p.add_argument('--cluster-size-distribution', choices=['fixed', 'geometric', 'zipf'],
+                       default=WORKLOAD_DEFAULTS['cluster_size_distribution'])
+        p.add_argument('--mean-cluster-size', type=float, default=WORKLOAD_DEFAULTS['mean_cluster_size'])
+        p.add_argument('--multi-gene-rate', type=float, default=WORKLOAD_DEFAULTS['multi_gene_rate'],
+                       help='Fraction of reads with a third gene')
+        p.add_argument('--neighbour-rate', type=float, default=WORKLOAD_DEFAULTS['neighbour_rate'],
+                       help='Fraction of clusters joining neighbouring genes (read-through candidates)')
+        p.add_argument('--noise-rate', type=float, default=WORKLOAD_DEFAULTS['noise_rate'],
+                       help='Fraction of reads with inconsistent block strands')
+
+    gen = subparsers.add_parser('generate', help='Write a synthetic workload')
+    gen.add_argument('workload', help='Output directory')
+    add_workload_arguments(gen)
+
+    run = subparsers.add_parser('run', help='Benchmark annotate calls, generating the workload if missing')
+    run.add_argument('--annotate-cmd', required=True, help="Command running Genion's annotate calls entry point")
+    run.add_argument('--workload', required=True, help='Workload directory')
+    run.add_argument('--threads', type=int, default=1)
+    run.add_argument('--repeats', type=int, default=3)
+    run.add_argument('--annotate-args', default='', help='Extra annotate arguments, e.g. "--segdup-footprint"')
+    run.add_argument('--output-files', help='Comma separated output files to hash '
+                     '(default: all but profile.json and calls.log)')
+    run.add_argument('--output', help='Result JSON (default: stdout)')
+    run.add_argument('--baseline', help='Baseline result JSON; exit with status 1 on regressions')
+    run.add_argument('--tolerance', type=float, default=0.10, help='Allowed slowdown fraction')
+    run.add_argument('--min-seconds', type=float, default=0.05, help='Ignore slowdowns smaller than this')
+    add_workload_arguments(run)
+
+    shard_check = subparsers.add_parser('shard-check', help='Check that a sharded run gives the single run output, '
+                                        'generating the workload if missing')
+    shard_check.add_argument('--annotate-cmd', required=True, help="Command running Genion's annotate calls entry point")
+    shard_check.add_argument('--workload', required=True, help='Workload directory')
+    shard_check.add_argument('--shards', type=int, default=3)
+    shard_check.add_argument('--threads', type=int, default=1)
+    add_workload_arguments(shard_check)
+    shard_check.set_defaults(**SHARD_CHECK_WORKLOAD)
+
+    args = parser.parse_args()
+    params = {key: getattr(args, key) for key in WORKLOAD_DEFAULTS}
+
+    if args.command == 'generate':
+        generate_workload(args.workload, **params)
+        return 0
+
+    if not os.path.exists(os.path.join(args.workload, 'workload.json')):
+        generate_workload(args.workload, **params)
+    if args.command == 'shard-check':
+        problems = check_shards(args.annotate_cmd, args.workload, args.shards, args.threads)
+        for problem in problems:
+            print(f"SHARD MISMATCH: {problem}", file=sys.stderr)
+        return 1 if problems else 0
+    result = run_benchmark(args.annotate_cmd, args.workload, args.threads, args.repeats,
+                           shlex.split(args.annotate_args),
+                           args.output_files.split(',') if args.output_files else None)
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        problems = compare_results(result, baseline, args.tolerance, args.min_seconds)
+        for problem in problems:
+            print(f"REGRESSION: {problem}", file=sys.stderr)
+        return 1 if problems else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""
+Genion Columnar Output Reader
+
+Reads the <sample>_genion.tsv.cols table the annotate stage writes when GENION_COLUMNAR_OUTPUT
+is set: one row per supporting read with typed columns (fusion_id, fusion_name, pass_fail,
+read_id, the support counts and scores). The file is memory mapped and only the requested
+columns are decoded, so loading read ids does not parse the scores and vice versa.
+
+Layout (all sections 8 byte aligned, little endian):
+    header      magic 'GNCOLTAB', uint32 version, uint32 column_count, uint64 row_count
+    columns     column_count descriptors: char name[32], uint32 type, uint32 reserved,
+                uint64 offset, uint64 length, uint64 strings_offset, uint64 string_count
+    sections    int32 / float64 values, or uint32 dictionary codes, and string sections of
+                uint64 offsets[string_count + 1] followed by the string bytes
+"""
+
+import mmap
+import struct
+
+import numpy as np
+
+
+MAGIC = b'GNCOLTAB'
+VERSION = 1
+HEADER = struct.Struct('<8sIIQ')
+COLUMN = struct.Struct('<32sIIQQQQ')
+
+INT32, FLOAT64, UTF8, DICTIONARY = 1, 2, 3, 4
+
+
+def _strings(buffer, offset, count):
+    offsets = np.frombuffer(buffer, dtype='<u8', count=count + 1, offset=offset)
+    start = offset + offsets.nbytes
+    return [bytes(buffer[start + offsets[k]:start + offsets[k + 1]]).decode()
+            for k in range(count)]
+
+
+def _check_section(buffer, path, name, offset, length):
+    if offset + length > len(buffer):
+        raise ValueError(f"{path} is truncated: column {name} ends at byte {offset + length} "
+                         f"of {len(buffer)}")
+
+
+def read_genion_columns(path, columns=None):
+    """
+    Load a Genion .cols table as a dict of column name to numpy array.
+
+    int32 and float64 columns are numeric arrays, utf8 and dictionary columns object arrays
+    of str. columns limits the result to those names (all columns by default).
+    Raises ValueError for files that are not a Genion table or are truncated.
+    """
+    with open(path, 'rb') as f:
+        buffer = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    if len(buffer) < HEADER.size or buffer[:len(MAGIC)] != MAGIC:
+        raise ValueError(f"{path} is not a Genion columnar table")
+    magic, version, column_count, row_count = HEADER.unpack_from(buffer, 0)
+    if version != VERSION:
+        raise ValueError(f"{path} has columnar table version {version}, expected {VERSION}")
+    _check_section(buffer, path, 'descriptors', HEADER.size, column_count * COLUMN.size)
+
+    table = {}
+    for k in range(column_count):
+        name, kind, _, offset, length, strings_offset, string_count = \
+            COLUMN.unpack_from(buffer, HEADER.size + k * COLUMN.size)
+        name = name.rstrip(b'\0').decode()
+        if columns is not None and name not in columns:
+            continue
+        _check_section(buffer, path, name, offset, length)
+        if kind in (UTF8, DICTIONARY):
+            _check_section(buffer, path, name, strings_offset, (string_count + 1) * 8)
+            string_bytes = struct.unpack_from('<Q', buffer, strings_offset + string_count * 8)[0]
+            _check_section(buffer, path, name, strings_offset, (string_count + 1) * 8 + string_bytes)
+        if kind == INT32:
+            table[name] = np.frombuffer(buffer, dtype='<i4', count=row_count, offset=offset).copy()
+        elif kind == FLOAT64:
+            table[name] = np.frombuffer(buffer, dtype='<f8', count=row_count, offset=offset).copy()
+        elif kind == UTF8:
+            table[name] = np.array(_strings(buffer, strings_offset, string_count), dtype=object)
+        elif kind == DICTIONARY:
+            values = np.array(_strings(buffer, strings_offset, string_count), dtype=object)
+            table[name] = values[np.frombuffer(buffer, dtype='<u4', count=row_count, offset=offset)]
+        else:
+            raise ValueError(f"{path}: column {name} has unknown type {kind}")
+    buffer.close()
+    return table
@@ -269,7 +269,15 @@ def run_genion_step(config, sam_files):
                 threads=genion_config.get('threads', 1),  # Use threads from config
                 keep_intermediate=genion_config.get('keep_debug', True),
                 log_path=os.path.join(genion_output_dir, 'run_genion.log'),
-                min_support=genion_config.get('min_support', 1)
+                min_support=genion_config.get('min_support', 1),
+                annotation_cache=genion_config.get('annotation_cache'),
+                normalized_output=genion_config.get('normalized_output', False),
+                columnar_output=genion_config.get('columnar_output', False),
+                segdup_footprint=genion_config.get('segdup_footprint', False),
+                profile=genion_config.get('profile', False),
+                low_memory=genion_config.get('low_memory', False),
+                spill_dir=genion_config.get('spill_dir'),
+                prune_low_support=genion_config.get('prune_low_support', False)
             )
             
             result_file = os.path.join(genion_output_dir, f'{sample_name}_genion.tsv')